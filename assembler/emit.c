@@ -0,0 +1,118 @@
+#include "emit.h"
+
+#include <string.h>
+
+static const char *emit_names[] = { "bin", "hex", "raw", "mem" };
+
+static const char hex_digit[16] = "0123456789abcdef";
+
+// Each nibble as four binary digits and a group separator
+static const char nibble_bin[16][5] =
+{
+    "0000 ", "0001 ", "0010 ", "0011 ", "0100 ", "0101 ", "0110 ", "0111 ",
+    "1000 ", "1001 ", "1010 ", "1011 ", "1100 ", "1101 ", "1110 ", "1111 ",
+};
+
+// Look up an output format by name. Returns 0 if it exists.
+int emit_format(const char *name, emit_fmt_t *fmt)
+{
+    size_t i;
+    for(i = 0; i < sizeof(emit_names) / sizeof(emit_names[0]); i++)
+    {
+        if(!strcmp(name, emit_names[i]))
+        {
+            *fmt = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static char *put_dec(char *p, uint64_t v)
+{
+    char tmp[20];
+    int n = 0;
+
+    do
+    {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while(v);
+    while(n) *p++ = tmp[--n];
+    return p;
+}
+
+static char *put_hex(char *p, uint64_t v, int digits)
+{
+    int i;
+    for(i = digits - 1; i >= 0; i--) p[digits - 1 - i] = hex_digit[(v >> (i * 4)) & 0xF];
+    return p + digits;
+}
+
+// Render one instruction at p, returns the end of what was written
+static char *emit_ins(char *p, instruction_t *ins, emit_fmt_t fmt)
+{
+    static const char pc_label[] = "Instruction at PC: ";
+    int i;
+
+    switch(fmt)
+    {
+        case EMIT_BIN:
+            memcpy(p, pc_label, sizeof(pc_label) - 1);
+            p = put_dec(p + sizeof(pc_label) - 1, ins->addr);
+            *p++ = '\n';
+            for(i = 28; i >= 0; i -= 4)
+            {
+                memcpy(p, nibble_bin[(ins->bin >> i) & 0xF], 5);
+                p += 5;
+            }
+            *p++ = '\n';
+            break;
+        case EMIT_HEX:
+            p = put_hex(p, ins->addr, 8);
+            *p++ = ':';
+            *p++ = ' ';
+            p = put_hex(p, ins->bin, 8);
+            *p++ = '\n';
+            break;
+        case EMIT_RAW:
+            *p++ = ins->bin & 0xFF;
+            *p++ = (ins->bin >> 8) & 0xFF;
+            *p++ = (ins->bin >> 16) & 0xFF;
+            *p++ = (ins->bin >> 24) & 0xFF;
+            break;
+        case EMIT_MEM:
+            p = put_hex(p, ins->bin, 8);
+            *p++ = '\n';
+            break;
+    }
+    return p;
+}
+
+// Write every instruction in the given format. Text is rendered into a
+// buffer and handed to stdio in EMIT_BUFSZ chunks. Returns 0 on success.
+int emit_program(FILE *f, ins_list_t *l, emit_fmt_t fmt)
+{
+    static char buf[EMIT_BUFSZ];
+    instruction_t *ins;
+    char *p = buf;
+
+    if(f == NULL || l == NULL) return 1;
+
+    if(fmt == EMIT_MEM)
+    {
+        memcpy(p, "@00000000\n", 10);
+        p += 10;
+    }
+    for(ins = l->head; ins != NULL; ins = ins->next)
+    {
+        p = emit_ins(p, ins, fmt);
+        if(p > buf + EMIT_BUFSZ - EMIT_LINE_MAX)
+        {
+            if(fwrite(buf, 1, p - buf, f) != (size_t)(p - buf)) return 1;
+            p = buf;
+        }
+    }
+    if(p > buf && fwrite(buf, 1, p - buf, f) != (size_t)(p - buf)) return 1;
+    return fflush(f) != 0;
+}
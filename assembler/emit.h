@@ -0,0 +1,22 @@
+#ifndef __EMIT_H__
+#define __EMIT_H__
+
+#include <stdio.h>
+
+#include "instruction.h"
+
+#define EMIT_BUFSZ (1 << 16)    // Output is rendered into a buffer this big
+#define EMIT_LINE_MAX 64        // Longest line any format renders
+
+typedef enum emit_fmt_e
+{
+    EMIT_BIN,   // "Instruction at PC: n" and the word in binary, one nibble per group
+    EMIT_HEX,   // "pc: word", both in hex
+    EMIT_RAW,   // Little-endian words, no text
+    EMIT_MEM    // Verilog $readmemh, one word per line
+} emit_fmt_t;
+
+int emit_format(const char *name, emit_fmt_t *fmt);
+int emit_program(FILE *f, ins_list_t *l, emit_fmt_t fmt);
+
+#endif // __EMIT_H__
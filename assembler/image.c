@@ -0,0 +1,114 @@
+#include "image.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+
+#define IMAGE_BUFSZ 4096 // Words staged per fwrite
+
+// Zero bytes up to the next 8-byte boundary
+static int image_pad(FILE *f, uint64_t *off)
+{
+    static const char zero[8] = { 0 };
+    size_t n = (8 - (*off & 7)) & 7;
+
+    *off += n;
+    return n && fwrite(zero, 1, n, f) != n;
+}
+
+// Symbol section: one entry per label in hash table order, then the names
+static int image_symbols(FILE *f, symtab_t *t)
+{
+    image_sym_t e;
+    uint64_t i, name_off = t->cnt * sizeof(image_sym_t);
+
+    for(i = 0; i < t->cap; i++)
+    {
+        if(t->tab[i].name == NULL) continue;
+        e.addr = htole64(t->tab[i].addr);
+        e.name_off = htole32(name_off);
+        e.name_len = htole32(t->tab[i].len);
+        if(fwrite(&e, sizeof(e), 1, f) != 1) return 1;
+        name_off += t->tab[i].len;
+    }
+    for(i = 0; i < t->cap; i++)
+    {
+        if(t->tab[i].name == NULL) continue;
+        if(fwrite(t->tab[i].name, 1, t->tab[i].len, f) != t->tab[i].len) return 1;
+    }
+    return 0;
+}
+
+// Write the header and sections. Returns nonzero if a write failed.
+static int image_emit(FILE *f, ins_list_t *l)
+{
+    image_hdr_t hdr;
+    instruction_t *ins;
+    uint32_t words[IMAGE_BUFSZ];
+    uint8_t opis[IMAGE_BUFSZ];
+    uint64_t off;
+    size_t n;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = htole32(IMAGE_VERSION);
+    hdr.cnt = htole64(l->cnt);
+    hdr.text_off = htole64(sizeof(image_hdr_t));
+    hdr.opi_off = htole64(sizeof(image_hdr_t) + ((l->cnt * 4 + 7) & ~7ULL));
+    if(l->syms->cnt)
+    {
+        hdr.sym_off = htole64(le64toh(hdr.opi_off) + ((l->cnt + 7) & ~7ULL));
+        hdr.sym_cnt = htole64(l->syms->cnt);
+    }
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1) return 1;
+    off = sizeof(hdr);
+
+    // Text section
+    for(ins = l->head, n = 0; ins != NULL; ins = ins->next)
+    {
+        words[n++] = htole32(ins->bin);
+        if(n == IMAGE_BUFSZ || ins->next == NULL)
+        {
+            if(fwrite(words, sizeof(uint32_t), n, f) != n) return 1;
+            off += n * sizeof(uint32_t);
+            n = 0;
+        }
+    }
+    if(image_pad(f, &off)) return 1;
+
+    // opcode_map index section
+    for(ins = l->head, n = 0; ins != NULL; ins = ins->next)
+    {
+        opis[n++] = ins->opi;
+        if(n == IMAGE_BUFSZ || ins->next == NULL)
+        {
+            if(fwrite(opis, sizeof(uint8_t), n, f) != n) return 1;
+            off += n;
+            n = 0;
+        }
+    }
+    if(image_pad(f, &off)) return 1;
+    return image_symbols(f, l->syms);
+}
+
+// Write the instruction list as a binary image, see image.h for the layout.
+// Returns 0 on success.
+int image_write(const char *path, ins_list_t *l)
+{
+    FILE *f;
+    int ret;
+
+    if(path == NULL || l == NULL) return 1;
+
+    f = fopen(path, "wb");
+    if(f == NULL)
+    {
+        perror("Cannot open image file. \n");
+        return 1;
+    }
+
+    ret = image_emit(f, l);
+    if(fclose(f)) ret = 1;
+    if(ret) fputs("ERROR: Failed to write image file\n", stderr);
+    return ret;
+}
@@ -1,5 +1,7 @@
+
 #include "instruction.h"
 #include <stdlib.h>
+#include <sys/mman.h>
 
 ins_list_t *ins_list_init()
 {
@@ -8,45 +10,144 @@ ins_list_t *ins_list_init()
     if(l == NULL) return NULL;
     l->head = NULL;
     l->tail = NULL;
+    l->pool = NULL;
+    l->cnt = 0;
+    l->syms = symtab_init();
+    l->relocs = relocs_init();
+    l->map = NULL;
+    l->map_size = 0;
+    if(l->syms == NULL || l->relocs == NULL)
+    {
+        symtab_delete(l->syms);
+        relocs_delete(l->relocs);
+        free(l);
+        return NULL;
+    }
 
     return l;
 }
 
 int ins_list_delete(ins_list_t *l)
 {
-    instruction_t *c, *n;
+    ins_pool_t *c, *n;
     if(l == NULL) return 1;
-    if(l->head != NULL)
+    for(c = l->pool; c != NULL; c = n)
     {
-        for(c = l->head; c != NULL; c = n)
-        {
-            n = c->next;
-            free(c);
-        }
+        n = c->next;
+        free(c);
     }
+    symtab_delete(l->syms);
+    relocs_delete(l->relocs);
+    if(l->map != NULL) munmap(l->map, l->map_size);
     free(l);
     return 0;
 }
 
-int ins_list_add(ins_list_t *l, uint64_t addr, uint32_t bin)
+int ins_list_add(ins_list_t *l, uint64_t addr, uint32_t bin, uint8_t opi)
 {
-    instruction_t *n, *p;
+    instruction_t *n;
+    ins_pool_t *p;
 
     if(l == NULL) return 1;
 
-    n = malloc(sizeof(instruction_t));
-    if(n == NULL) return 2;
+    p = l->pool;
+    if(p == NULL || p->used == INS_POOL_CHUNK)
+    {
+        p = malloc(sizeof(ins_pool_t));
+        if(p == NULL) return 2;
+        p->next = l->pool;
+        p->used = 0;
+        l->pool = p;
+    }
+    n = &p->ins[p->used++];
 
     n->addr = addr;
     n->bin = bin;
+    n->opi = opi;
     n->next = NULL;
 
     if(l->head == NULL) l->head = n;
-    else
+    else l->tail->next = n;
+    l->tail = n;
+    l->cnt++;
+    return 0;
+}
+
+// Registers an instruction really reads and writes, -1 if none. x0 is an
+// ordinary register in the simulators, so it is not special here either.
+void ins_regs(uint32_t bin, uint8_t opi, int *rd, int *rs1, int *rs2)
+{
+    *rd = *rs1 = *rs2 = -1;
+    switch(opcode_map[opi].type)
     {
-        for(p = l->head; p->next != NULL; p = p->next);
-        p->next = n;
+        case R_TYPE:
+            *rs2 = (bin >> 20) & 0x1F;
+            // fall through
+        case I_TYPE:
+            *rs1 = (bin >> 15) & 0x1F;
+            // fall through
+        case U_TYPE:
+        case UJ_TYPE:
+            *rd = (bin >> 7) & 0x1F;
+            break;
+        case S_TYPE:
+        case SB_TYPE:
+            *rs1 = (bin >> 15) & 0x1F;
+            *rs2 = (bin >> 20) & 0x1F;
+            break;
+        default:
+            break;
     }
-    return 0;
 }
 
+// Index of the instruction a branch or jal at index i goes to. The end of the
+// program, index n, is a valid target. Returns -1 for anything else.
+int64_t ins_target(uint32_t bin, uint64_t i, uint64_t n)
+{
+    int32_t imm;
+    int64_t t;
+
+    if(ins_opcode(bin) == 0x63)
+    {
+        imm = ((bin >> 31) & 1) << 12 | ((bin >> 7) & 1) << 11 | ((bin >> 25) & 0x3F) << 5 | ((bin >> 8) & 0xF) << 1;
+        imm = (imm << 19) >> 19;
+    }
+    else if(ins_opcode(bin) == 0x6F)
+    {
+        imm = ((bin >> 31) & 1) << 20 | ((bin >> 12) & 0xFF) << 12 | ((bin >> 20) & 1) << 11 | ((bin >> 21) & 0x3FF) << 1;
+        imm = (imm << 11) >> 11;
+    }
+    else return -1;
+    if(imm % 4) return -1;
+    t = (int64_t)i + imm / 4;
+    return t >= 0 && (uint64_t)t <= n ? t : -1;
+}
+
+// Mark the first instruction of every basic block in a zeroed array of n + 2
+// flags. Blocks start at the program entry, at labels, at branch and jump
+// targets and after a control transfer's delay slot. Returns NULL if out of
+// memory.
+uint8_t *ins_leaders(ins_list_t *l, const uint32_t *bin, uint64_t n)
+{
+    uint8_t *leader;
+    uint64_t i;
+    int64_t t;
+
+    leader = calloc(n + 2, 1);
+    if(leader == NULL) return NULL;
+
+    leader[0] = 1;
+    for(i = 0; i < l->syms->cap; i++)
+    {
+        if(l->syms->tab[i].name != NULL && l->syms->tab[i].addr / 4 <= n) leader[l->syms->tab[i].addr / 4] = 1;
+    }
+    for(i = 0; i < n; i++)
+    {
+        if(!ins_is_barrier(bin[i])) continue;
+        t = ins_target(bin[i], i, n);
+        if(t >= 0) leader[t] = 1;
+        // Past the delay slot
+        leader[i + 2] = 1;
+    }
+    return leader;
+}
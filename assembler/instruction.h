@@ -2,13 +2,18 @@
 #define __INSTRUCTION_H__
 
 #include <stdint.h>
+#include <stddef.h>
+
+#include "symtab.h"
 
 #define NOPS 57
+#define INS_POOL_CHUNK 4096 // Instructions allocated at once by ins_list_add
 
 typedef enum ins_type_e ins_type_t;
 typedef struct opcode_s opcode_t;
 typedef struct instruction_s instruction_t;
 typedef struct ins_list_s ins_list_t;
+typedef struct ins_pool_s ins_pool_t;
 
 enum ins_type_e 
 {
@@ -34,18 +39,36 @@ struct instruction_s
 {
     uint64_t addr;
     uint32_t bin;
+    uint8_t opi;        // opcode_map index
     instruction_t *next;
 };
 
+// Instructions are carved out of fixed-size chunks instead of one malloc each
+struct ins_pool_s
+{
+    ins_pool_t *next;
+    uint64_t used;
+    instruction_t ins[INS_POOL_CHUNK];
+};
+
 struct ins_list_s
 {
     instruction_t *head;
     instruction_t *tail;
+    ins_pool_t *pool;   // Chunk currently being filled, older chunks follow
+    uint64_t cnt;
+    symtab_t *syms;     // Labels, their names point into the trace mapping
+    relocs_t *relocs;   // Label references, in list order
+    void *map;          // Trace mapping, kept until the list is deleted
+    size_t map_size;
 };
 
 ins_list_t *ins_list_init();
 int ins_list_delete(ins_list_t *l);
-int ins_list_add(ins_list_t *l, uint64_t addr, uint32_t bin);
+int ins_list_add(ins_list_t *l, uint64_t addr, uint32_t bin, uint8_t opi);
+void ins_regs(uint32_t bin, uint8_t opi, int *rd, int *rs1, int *rs2);
+int64_t ins_target(uint32_t bin, uint64_t i, uint64_t n);
+uint8_t *ins_leaders(ins_list_t *l, const uint32_t *bin, uint64_t n);
 
 static opcode_t opcode_map[NOPS] =
 {
@@ -68,8 +91,8 @@ static opcode_t opcode_map[NOPS] =
     {"auipc",  0x17, U_TYPE,  0x0, 0x00},
     {"addiw",  0x1B, I_TYPE,  0x0, 0x00},
     {"slliw",  0x1B, I_TYPE,  0x1, 0x00},
-    {"srliw",  0x1B, I_TYPE,  0x3, 0x00},
-    {"sraiw",  0x1B, I_TYPE,  0x3, 0x20},
+    {"srliw",  0x1B, I_TYPE,  0x5, 0x00},
+    {"sraiw",  0x1B, I_TYPE,  0x5, 0x20},
     {"sb",     0x23, S_TYPE,  0x0, 0x00},
     {"sh",     0x23, S_TYPE,  0x1, 0x00},
     {"sw",     0x23, S_TYPE,  0x2, 0x00},
@@ -108,5 +131,120 @@ static opcode_t opcode_map[NOPS] =
     {"CSRRCI", 0x73, I_TYPE,  0x7, 0x00},
 };
 
+static inline uint8_t ins_opcode(uint32_t bin)
+{
+    return bin & 0x7F;
+}
+
+static inline int ins_is_load(uint32_t bin)
+{
+    return ins_opcode(bin) == 0x03;
+}
+
+static inline int ins_is_store(uint32_t bin)
+{
+    return ins_opcode(bin) == 0x23;
+}
+
+// Control transfers and instructions whose result depends on where they sit
+static inline int ins_is_barrier(uint32_t bin)
+{
+    switch(ins_opcode(bin))
+    {
+        case 0x17:  // auipc
+        case 0x63:  // branches
+        case 0x67:  // jalr
+        case 0x6F:  // jal
+        case 0x73:  // ecall, ebreak, CSR
+            return 1;
+    }
+    return 0;
+}
+
+// Whether b right after a stalls in pipeline/RISCV_core. Its hazard detection
+// unit compares the raw register fields whatever the instruction type.
+static inline int ins_load_use(uint32_t a, uint32_t b)
+{
+    uint32_t rd = (a >> 7) & 0x1F;
+    return ins_is_load(a) && (((b >> 15) & 0x1F) == rd || ((b >> 20) & 0x1F) == rd);
+}
+
+// Perfect hash over the mnemonics in opcode_map. A mnemonic is packed
+// little-endian into a 64-bit key and MNEMONIC_HASH() maps every key in the
+// table to its own slot, so a lookup is one multiply and one key compare.
+// MNEMONIC_HASH_MUL was found by an offline search; adding an instruction to
+// opcode_map means regenerating this table (and possibly the multiplier).
+#define MNEMONIC_MAXLEN 8
+#define MNEMONIC_HASH_BITS 7
+#define MNEMONIC_HASH_MUL 0x5482b5fc9782ebd1ULL
+#define MNEMONIC_HASH(key) (((key) * MNEMONIC_HASH_MUL) >> (64 - MNEMONIC_HASH_BITS))
+
+typedef struct
+{
+    uint64_t key;
+    uint8_t opi;
+} mnemonic_slot_t;
+
+static const mnemonic_slot_t mnemonic_table[1 << MNEMONIC_HASH_BITS] =
+{
+    [  0] = {0x000000006273, 21}, // sb
+    [  1] = {0x000075746c73, 29}, // sltu
+    [  2] = {0x000000006473, 24}, // sd
+    [  4] = {0x00000069756c, 35}, // lui
+    [  8] = {0x000000006873, 22}, // sh
+    [ 16] = {0x000000617273, 32}, // sra
+    [ 19] = {0x495352525343, 55}, // CSRRSI
+    [ 20] = {0x007769617273, 20}, // sraiw
+    [ 21] = {0x000000646461, 25}, // add
+    [ 22] = {0x000069746c73,  9}, // slti
+    [ 23] = {0x000075656762, 46}, // bgeu
+    [ 24] = {0x005752525343, 51}, // CSRRW
+    [ 25] = {0x007769646461, 17}, // addiw
+    [ 26] = {0x6b6165726265, 50}, // ebreak
+    [ 32] = {0x000000716562, 41}, // beq
+    [ 35] = {0x000000646e61, 34}, // and
+    [ 37] = {0x0000006c616a, 48}, // jal
+    [ 38] = {0x0000776c6c73, 38}, // sllw
+    [ 40] = {0x000000656e62, 42}, // bne
+    [ 41] = {0x006c6c616365, 49}, // ecall
+    [ 42] = {0x000000726f78, 30}, // xor
+    [ 44] = {0x004352525343, 53}, // CSRRC
+    [ 46] = {0x0000776c7273, 39}, // srlw
+    [ 47] = {0x000000627573, 26}, // sub
+    [ 51] = {0x000075746c62, 45}, // bltu
+    [ 52] = {0x00000000776c,  2}, // lw
+    [ 53] = {0x007569746c73, 10}, // sltiu
+    [ 62] = {0x0000696c6c73,  8}, // slli
+    [ 63] = {0x00000069726f, 14}, // ori
+    [ 64] = {0x006370697561, 16}, // auipc
+    [ 66] = {0x495752525343, 54}, // CSRRWI
+    [ 69] = {0x000077617273, 40}, // sraw
+    [ 70] = {0x0000696c7273, 12}, // srli
+    [ 72] = {0x000000746c73, 28}, // slt
+    [ 74] = {0x000077646461, 36}, // addw
+    [ 75] = {0x00000075776c,  6}, // lwu
+    [ 87] = {0x494352525343, 56}, // CSRRCI
+    [ 88] = {0x00000000626c,  0}, // lb
+    [ 91] = {0x00000000646c,  3}, // ld
+    [ 92] = {0x000000007773, 23}, // sw
+    [ 93] = {0x000069617273, 13}, // srai
+    [ 94] = {0x000000656762, 44}, // bge
+    [ 96] = {0x00000000686c,  1}, // lh
+    [ 98] = {0x000069646461,  7}, // addi
+    [ 99] = {0x0000726c616a, 47}, // jalr
+    [100] = {0x000077627573, 37}, // subw
+    [105] = {0x005352525343, 52}, // CSRRS
+    [108] = {0x00000000726f, 33}, // or
+    [110] = {0x00000075626c,  4}, // lbu
+    [112] = {0x000069646e61, 15}, // andi
+    [113] = {0x0000006c6c73, 27}, // sll
+    [117] = {0x0077696c6c73, 18}, // slliw
+    [118] = {0x00000075686c,  5}, // lhu
+    [119] = {0x000069726f78, 11}, // xori
+    [121] = {0x0000006c7273, 31}, // srl
+    [122] = {0x000000746c62, 43}, // blt
+    [125] = {0x0077696c7273, 19}, // srliw
+};
+
 #endif // __INSTRUCTION_H__
 
@@ -0,0 +1,180 @@
+#include "linecache.h"
+#include "image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Eight bytes at a time, the length check on lookup guards the rest
+uint64_t linecache_hash(const char *s, uint32_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t w;
+
+    for(; len >= 8; s += 8, len -= 8)
+    {
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+// Slot holding the line, or the empty slot where it belongs
+static const lc_entry_t *lc_slot(const lc_entry_t *tab, uint64_t cap, uint64_t hash, uint32_t len)
+{
+    uint64_t i = hash & (cap - 1);
+
+    while(tab[i].len != 0 && (tab[i].hash != hash || tab[i].len != len)) i = (i + 1) & (cap - 1);
+    return &tab[i];
+}
+
+static int lc_grow(linecache_t *c)
+{
+    uint64_t cap = c->cap * 2;
+    lc_entry_t *tab;
+    uint64_t i;
+
+    tab = calloc(cap, sizeof(lc_entry_t));
+    if(tab == NULL) return 2;
+    for(i = 0; i < c->cap; i++)
+    {
+        if(c->tab[i].len == 0) continue;
+        *(lc_entry_t *)lc_slot(tab, cap, c->tab[i].hash, c->tab[i].len) = c->tab[i];
+    }
+    free(c->tab);
+    c->tab = tab;
+    c->cap = cap;
+    return 0;
+}
+
+// Map the cache at path if there is a usable one; a missing or stale file
+// just means every line is assembled
+static void lc_map(linecache_t *c, const char *path)
+{
+    lc_hdr_t hdr;
+    struct stat st;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) return;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr) ||
+       pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+       memcmp(hdr.magic, LINECACHE_MAGIC, sizeof(hdr.magic)) || hdr.version != IMAGE_VERSION ||
+       hdr.cap == 0 || (hdr.cap & (hdr.cap - 1)) || hdr.cnt >= hdr.cap ||
+       hdr.cap > (st.st_size - sizeof(hdr)) / sizeof(lc_entry_t) ||
+       (size_t)st.st_size != sizeof(hdr) + hdr.cap * sizeof(lc_entry_t))
+    {
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return;
+    c->map = map;
+    c->map_size = st.st_size;
+    c->old = (const lc_entry_t *)(map + sizeof(hdr));
+    c->old_cap = hdr.cap;
+}
+
+linecache_t *linecache_open(const char *path)
+{
+    linecache_t *c;
+    c = calloc(1, sizeof(linecache_t));
+    if(c == NULL) return NULL;
+    c->tab = calloc(LINECACHE_MINSZ, sizeof(lc_entry_t));
+    if(c->tab == NULL)
+    {
+        free(c);
+        return NULL;
+    }
+    c->cap = LINECACHE_MINSZ;
+    lc_map(c, path);
+
+    return c;
+}
+
+void linecache_delete(linecache_t *c)
+{
+    if(c == NULL) return;
+    if(c->map != NULL) munmap(c->map, c->map_size);
+    free(c->tab);
+    free(c);
+}
+
+// Entry for a line from the previous run, NULL if the line is new
+const lc_entry_t *linecache_find(linecache_t *c, uint64_t hash, uint32_t len)
+{
+    const lc_entry_t *e;
+
+    c->lines++;
+    if(c->old == NULL) return NULL;
+    e = lc_slot(c->old, c->old_cap, hash, len);
+    if(e->len == 0) return NULL;
+    c->hits++;
+    return e;
+}
+
+// Remember a line for the next run. Repeated lines are stored once.
+int linecache_add(linecache_t *c, const lc_entry_t *e)
+{
+    lc_entry_t *s;
+
+    if((c->cnt + 1) * 2 > c->cap && lc_grow(c)) return 2;
+
+    s = (lc_entry_t *)lc_slot(c->tab, c->cap, e->hash, e->len);
+    if(s->len != 0) return 0;
+    *s = *e;
+    c->cnt++;
+    return 0;
+}
+
+// Replace the cache at path with this run's table. It is written to a
+// temporary file and renamed over, so an interrupted run never leaves a
+// truncated cache and the old table can stay mapped until then.
+// Returns 0 on success.
+int linecache_write(linecache_t *c, const char *path)
+{
+    lc_hdr_t hdr;
+    char *tmp;
+    FILE *f;
+    int ret;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LINECACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGE_VERSION;
+    hdr.cnt = c->cnt;
+    hdr.cap = c->cap;
+
+    tmp = malloc(strlen(path) + 5);
+    if(tmp == NULL) return 2;
+    sprintf(tmp, "%s.tmp", path);
+
+    f = fopen(tmp, "wb");
+    if(f == NULL)
+    {
+        perror("Cannot open line cache file. \n");
+        free(tmp);
+        return 1;
+    }
+    ret = fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+          fwrite(c->tab, sizeof(lc_entry_t), c->cap, f) != c->cap;
+    if(fclose(f)) ret = 1;
+    if(ret == 0 && rename(tmp, path)) ret = 1;
+    if(ret)
+    {
+        fputs("ERROR: Failed to write line cache file\n", stderr);
+        unlink(tmp);
+    }
+    free(tmp);
+    return ret;
+}
@@ -0,0 +1,61 @@
+#ifndef __LINECACHE_H__
+#define __LINECACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Cache of assembled lines, written next to a binary image by 'assembler -u'
+// and reused on the next run so only edited lines go through
+// handle_instruction(). Entries are keyed by a hash of the raw line text and
+// hold the word before label fixups. The file is an open-addressing table in
+// host byte order, mapped as-is:
+//  lc_hdr_t followed by cap lc_entry_t slots, empty slots have len 0
+// opi values depend on opcode_map, so the cache records IMAGE_VERSION and is
+// ignored when that changes.
+#define LINECACHE_MAGIC "RVLC"
+#define LINECACHE_SUFFIX ".cache"
+#define LINECACHE_MINSZ 1024    // Initial slots, always a power of two
+
+#define LC_DEF      0x1         // Line starts with a label definition
+#define LC_NOINS    0x2         // Line is only a label definition
+
+typedef struct lc_hdr_s
+{
+    char magic[4];          // LINECACHE_MAGIC, no terminator
+    uint32_t version;       // IMAGE_VERSION of the assembler that wrote it
+    uint64_t cnt;           // Lines in the table
+    uint64_t cap;           // Slots in the table
+} lc_hdr_t;
+
+typedef struct lc_entry_s
+{
+    uint64_t hash;
+    uint32_t len;           // Line length without the newline
+    uint32_t bin;           // Encoded word, label reference not yet patched
+    uint8_t opi;            // opcode_map index
+    uint8_t flags;          // LC_*
+    uint8_t ref;            // Token holding the label reference, 0 if none
+    uint8_t pad[5];
+} lc_entry_t;
+
+typedef struct linecache_s
+{
+    const lc_entry_t *old;  // Table from the previous run, NULL if none
+    uint64_t old_cap;
+    void *map;
+    size_t map_size;
+    lc_entry_t *tab;        // Table for this run, every line of the trace
+    uint64_t cnt;
+    uint64_t cap;
+    uint64_t lines;         // Lines looked up and how many were reused
+    uint64_t hits;
+} linecache_t;
+
+linecache_t *linecache_open(const char *path);
+void linecache_delete(linecache_t *c);
+uint64_t linecache_hash(const char *s, uint32_t len);
+const lc_entry_t *linecache_find(linecache_t *c, uint64_t hash, uint32_t len);
+int linecache_add(linecache_t *c, const lc_entry_t *e);
+int linecache_write(linecache_t *c, const char *path);
+
+#endif // __LINECACHE_H__
@@ -1,7 +1,15 @@
 /* RISC-V assembler implementation.
  *
  * Build executable as follows: make clean && make 
- * Execute as follows: ./assembler trace_1 
+ * Execute as follows: ./assembler [-O] [-S] [-f bin|hex|raw|mem] [-o image [-u]] trace_1 
+ *
+ * -f picks the output format: the binary listing (default), hex, raw
+ *    little-endian words, or a Verilog $readmemh file
+ * -o also writes the program as a binary image that RISCV_core can map directly
+ * -u keeps a line cache next to the image (image.cache) and only reassembles
+ *    lines that changed since the last -u run
+ * -O runs the peephole optimizer and reports what each of its rules saved
+ * -S reorders each basic block to hide load-use stalls in pipeline/RISCV_core
  *
  * Modified: Naga Kandasamy
  * Date: July 16, 2024
@@ -13,40 +21,136 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
 #include "parser.h"
+#include "image.h"
+#include "emit.h"
+#include "linecache.h"
+#include "sched.h"
+#include "peep.h"
 
 int main(int argc, char **argv)
 {	
-    uint64_t PC = 0;
     ins_list_t *l;
-    instruction_t *ins;
+    const char *image = NULL;
+    emit_fmt_t fmt = EMIT_BIN;
+    linecache_t *cache = NULL;
+    char *cache_path = NULL;
+    bool update = false;
+    bool sched = false;
+    bool opt_peep = false;
+    bool fixed;
+    sched_stats_t st;
+    peep_stats_t pst[PEEP_NRULES];
+    int opt, i;
 
-    if (argc != 2) 
+    while ((opt = getopt(argc, argv, "o:f:uSO")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                image = optarg;
+                break;
+            case 'u':
+                update = true;
+                break;
+            case 'S':
+                sched = true;
+                break;
+            case 'O':
+                opt_peep = true;
+                break;
+            case 'f':
+                if(emit_format(optarg, &fmt) == 0) break;
+                fprintf(stderr, "Unknown output format: %s\n", optarg);
+                // fall through
+            default:
+                printf("Usage: %s [-O] [-S] [-f bin|hex|raw|mem] [-o image [-u]] <trace-file>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1 || (update && image == NULL)) 
     {
-        printf("Usage: %s <trace-file>\n", argv[0]);
+        printf("Usage: %s [-O] [-S] [-f bin|hex|raw|mem] [-o image [-u]] <trace-file>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+
+    // Only the default listing keeps the per-instruction field dump, and
+    // cached lines are not parsed so there is nothing to dump for them
+    parse_dump = fmt == EMIT_BIN && !update;
+
+    if(update)
+    {
+        cache_path = malloc(strlen(image) + sizeof(LINECACHE_SUFFIX));
+        if(cache_path == NULL) exit(EXIT_FAILURE);
+        sprintf(cache_path, "%s%s", image, LINECACHE_SUFFIX);
+        cache = linecache_open(cache_path);
+        if(cache == NULL)
+        {
+            fputs("ERROR: Failed to initialize line cache\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
     
-    l = load_instructions(argv[1]);
+    l = load_instructions(argv[optind], cache);
 
-    for(ins = l->head; ins != NULL; ins = ins->next)
+    if(opt_peep)
     {
-        printf("Instruction at PC: %llu\n", PC);
-        unsigned mask = (1 << 31);
-        for(int i = 31; i >= 0; i--)
+        if(peephole_program(l, pst, &fixed))
         {
-            if(ins->bin & mask) printf("1");
-            else printf("0"); 
-            if(!(i % 4)) printf(" ");
+            fputs("ERROR: Failed to optimize program\n", stderr);
+            ins_list_delete(l);
+            exit(EXIT_FAILURE);
+        }
+        for(i = 0; i < PEEP_NRULES; i++)
+        {
+            fprintf(stderr, "Peephole %-10s: %llu removed, %llu rewritten, %lld cycles saved\n", pst[i].name,
+                    (unsigned long long)pst[i].removed, (unsigned long long)pst[i].rewritten, (long long)pst[i].cycles);
+        }
+        if(fixed) fputs("Peephole: code addresses are computed (auipc, jalr or lui of a label), nothing was removed\n", stderr);
+    }
 
-            mask >>= 1;
+    if(sched)
+    {
+        if(schedule_program(l, &st))
+        {
+            fputs("ERROR: Failed to schedule program\n", stderr);
+            ins_list_delete(l);
+            exit(EXIT_FAILURE);
         }
-        puts("");
+        fprintf(stderr, "Scheduler: %llu blocks, %llu instructions moved, load-use stalls %llu -> %llu\n",
+                (unsigned long long)st.blocks, (unsigned long long)st.moved,
+                (unsigned long long)st.before, (unsigned long long)st.after);
+    }
 
-        PC += 4;
+    if(emit_program(stdout, l, fmt))
+    {
+        fputs("ERROR: Failed to write program\n", stderr);
+        ins_list_delete(l);
+        exit(EXIT_FAILURE);
+    }
+
+    if(image != NULL && image_write(image, l))
+    {
+        ins_list_delete(l);
+        exit(EXIT_FAILURE);
+    }
+
+    if(cache != NULL)
+    {
+        fprintf(stderr, "Line cache: reused %llu of %llu lines\n",
+                (unsigned long long)cache->hits, (unsigned long long)cache->lines);
+        if(linecache_write(cache, cache_path))
+        {
+            ins_list_delete(l);
+            exit(EXIT_FAILURE);
+        }
+        linecache_delete(cache);
+        free(cache_path);
     }
 
     ins_list_delete(l);
     exit(EXIT_SUCCESS);
 }
-
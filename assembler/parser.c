@@ -3,35 +3,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-uint32_t(* parse_funcs[])(opcode_t *opcode, int tokc, char *tokv[]) =
+// Print the fields of each instruction as it is assembled
+bool parse_dump = true;
+
+uint32_t(* parse_funcs[])(opcode_t *opcode, int tokc, tok_t tokv[]) =
 {
     &parse_NULL_type,
     &parse_R_type, 
     &parse_I_type, 
     &parse_S_type, 
-    &parse_SB_type, 
-    &parse_U_type, 
-    &parse_UJ_type, 
 };
 
-ins_list_t *load_instructions(const char *trace)
+// Formats whose last operand may be a label instead of a number
+uint32_t(* parse_label_funcs[])(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label) =
 {
-    printf("Loading trace file: %s\n\n", trace);
-    FILE *fd = fopen(trace, "r");
-    if (fd == NULL) 
+    [SB_TYPE] = &parse_SB_type,
+    [U_TYPE] =  &parse_U_type,
+    [UJ_TYPE] = &parse_UJ_type,
+};
+
+static void resolve_labels(ins_list_t *l);
+
+// Assemble a trace. With a line cache, lines seen in the previous run reuse
+// their encoding and only new or edited lines are parsed.
+ins_list_t *load_instructions(const char *trace, linecache_t *cache)
+{
+    if(parse_dump) printf("Loading trace file: %s\n\n", trace);
+    int fd = open(trace, O_RDONLY);
+    if (fd < 0) 
     {
         perror("Cannot open trace file. \n");
         exit(EXIT_FAILURE); 
     }
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    char *tokv[MAXTOKS];
-    int tokc;
-    uint32_t bin;
+    struct stat st;
+    const char *buf = NULL;
+    const char *p, *end, *next, *eol;
+    tok_t tokv[MAXTOKS];
+    tok_t *t;
+    tok_t label;
+    int tokc, i;
+    uint32_t bin = 0;
+    uint8_t opi = 0;
     ins_list_t *l;
+    lc_entry_t ent;
+    const lc_entry_t *hit;
+
+    // Map the whole trace and tokenize it in place
+    if(fstat(fd, &st) < 0)
+    {
+        perror("Cannot stat trace file. \n");
+        exit(EXIT_FAILURE);
+    }
+    if(st.st_size > 0)
+    {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(buf == MAP_FAILED)
+        {
+            perror("Cannot map trace file. \n");
+            exit(EXIT_FAILURE);
+        }
+        madvise((void *)buf, st.st_size, MADV_SEQUENTIAL);
+    }
+    end = buf + st.st_size;
 
     l = ins_list_init();
     if(l == NULL)
@@ -39,49 +79,180 @@ ins_list_t *load_instructions(const char *trace)
         fputs("ERROR: Failed to initialize instruction list", stderr);
         exit(EXIT_FAILURE);
     }
+    // Label names are views into the trace, so the list keeps it mapped
+    l->map = (void *)buf;
+    l->map_size = st.st_size;
+    close(fd);
 
     uint64_t pc = 0;
 
-    while ((read = getline(&line, &len, fd)) != EOF) {
-        tokc = tokenize(line, tokv, MAXTOKS, ", \n");
+    for (p = buf; p < end; p = next) {
+        hit = NULL;
+        memset(&ent, 0, sizeof(ent));
+        if(cache != NULL)
+        {
+            eol = memchr(p, '\n', end - p);
+            if(eol == NULL) eol = end;
+            ent.len = eol - p;
+            ent.hash = linecache_hash(p, ent.len);
+            hit = linecache_find(cache, ent.hash, ent.len);
+
+            // An unchanged line without labels needs no parsing at all
+            if(hit != NULL && hit->flags == 0 && hit->ref == 0)
+            {
+                next = eol < end ? eol + 1 : end;
+                if(linecache_add(cache, hit) || ins_list_add(l, pc, hit->bin, hit->opi))
+                {
+                    fputs("ERROR: Failed to add instruction to list\n", stderr);
+                    exit(EXIT_FAILURE);
+                }
+                pc += 4;
+                continue;
+            }
+        }
+
+        tokc = tokenize(p, end, tokv, MAXTOKS, &next);
         if(tokc == 0) 
         {
-            fprintf(stderr, "Failed to tokenize line\n");
+            fputs("Failed to tokenize line\n", stderr);
             exit(EXIT_FAILURE);
         }
 
-        bin = handle_instruction(tokc, tokv);
-        ins_list_add(l, pc, bin);
+        // A leading "name:" labels the next instruction
+        t = tokv;
+        if(t[0].s[t[0].len - 1] == ':')
+        {
+            if(!is_label_name(t[0].s, t[0].len - 1))
+            {
+                fprintf(stderr, "ERROR: Invalid label: %.*s\n", t[0].len, t[0].s);
+                exit(EXIT_FAILURE);
+            }
+            if(symtab_add(l->syms, t[0].s, t[0].len - 1, pc))
+            {
+                fprintf(stderr, "ERROR: Duplicate label: %.*s\n", t[0].len - 1, t[0].s);
+                exit(EXIT_FAILURE);
+            }
+            ent.flags |= LC_DEF;
+            t++;
+        }
+
+        label.len = 0;
+        if(t == tokv + tokc)
+        {
+            ent.flags |= LC_NOINS;
+        }
+        else if(hit != NULL)
+        {
+            // Only the label reference has to be found again
+            bin = hit->bin;
+            opi = hit->opi;
+            if(hit->ref) label = tokv[hit->ref];
+        }
+        else
+        {
+            bin = handle_instruction(tokc - (t - tokv), t, &opi, &label);
+        }
+
+        if(cache != NULL)
+        {
+            ent.bin = bin;
+            ent.opi = opi;
+            for(i = 0; label.len && i < tokc && tokv[i].s != label.s; i++);
+            ent.ref = label.len ? i : 0;
+            // A reference that is not a whole token cannot be found again
+            if((label.len == 0 || i < tokc) && linecache_add(cache, &ent))
+            {
+                fputs("ERROR: Failed to update line cache\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(ent.flags & LC_NOINS) continue;
+
+        if(label.len && relocs_add(l->relocs, l->cnt, label.s, label.len))
+        {
+            fputs("ERROR: Failed to record label reference\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        if(ins_list_add(l, pc, bin, opi))
+        {
+            fputs("ERROR: Failed to add instruction to list\n", stderr);
+            exit(EXIT_FAILURE);
+        }
 
         pc += 4;
     }
 
-    fclose(fd);
+    resolve_labels(l);
     return l;
 }
 
-uint32_t handle_instruction(int tokc, char *tokv[])
+// Second pass: patch every label reference now that all labels are known.
+// Relocations are in list order, so one walk of the list covers them all.
+static void resolve_labels(ins_list_t *l)
 {
-    int opi;
-    for(opi = 0; opi < NOPS; opi++)
+    relocs_t *relocs = l->relocs;
+    instruction_t *ins = l->head;
+    const sym_t *sym;
+    reloc_t *r;
+    uint64_t i, n = 0;
+
+    for(i = 0; i < relocs->cnt; i++)
     {
-        opcode_t *op = &opcode_map[opi];
-        if(!strcmp(tokv[0], op->name))
+        r = &relocs->r[i];
+        for(; n < r->index; n++) ins = ins->next;
+
+        sym = symtab_find(l->syms, r->name, r->len);
+        if(sym == NULL)
         {
-            if(op->type == NULL_TYPE)
-            {
-                fprintf(stderr, "Library is broken. My bad\n");
-                exit(EXIT_FAILURE);
-            }
-            return parse_funcs[op->type](op, tokc, tokv); 
+            fprintf(stderr, "ERROR: Undefined label: %.*s\n", r->len, r->name);
+            exit(EXIT_FAILURE);
+        }
+        if(reloc_apply(&ins->bin, ins->addr, sym->addr))
+        {
+            fprintf(stderr, "ERROR: Label out of range: %.*s\n", r->len, r->name);
+            exit(EXIT_FAILURE);
         }
     }
-    fprintf(stderr, "Failed to parse instruction: %s\n", tokv[0]);
-    exit(EXIT_FAILURE);
+}
+
+uint32_t handle_instruction(int tokc, tok_t tokv[], uint8_t *opi, tok_t *label)
+{
+    opcode_t *op;
+    int i = lookup_opcode(tokv[0].s, tokv[0].len);
+
+    if(i < 0)
+    {
+        fprintf(stderr, "Failed to parse instruction: %.*s\n", tokv[0].len, tokv[0].s);
+        exit(EXIT_FAILURE);
+    }
+    op = &opcode_map[i];
+    *opi = i;
+    label->len = 0;
+    if(op->type == NULL_TYPE)
+    {
+        fprintf(stderr, "Library is broken. My bad\n");
+        exit(EXIT_FAILURE);
+    }
+    if(op->type >= SB_TYPE) return parse_label_funcs[op->type](op, tokc, tokv, label);
+    return parse_funcs[op->type](op, tokc, tokv);
+}
+
+// Find a mnemonic through the perfect hash, returning its opcode_map index or -1
+int lookup_opcode(const char *name, size_t len)
+{
+    const mnemonic_slot_t *slot;
+    uint64_t key = 0;
+    size_t i;
+
+    if(len == 0 || len > MNEMONIC_MAXLEN) return -1;
+    for(i = 0; i < len; i++) key |= (uint64_t)(uint8_t)name[i] << (8 * i);
+
+    slot = &mnemonic_table[MNEMONIC_HASH(key)];
+    return slot->key == key ? slot->opi : -1;
 }
 
 // Parse and assemble R-type instruction 
-uint32_t parse_R_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_R_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {
     immreg_t immreg;
     int ret = 0;
@@ -109,14 +280,17 @@ uint32_t parse_R_type(opcode_t *opcode, int tokc, char *tokv[])
     rs2 = immreg.reg;
 
     // Print the tokens 
-    puts("R-Type");
-    printf("opcode: 0x%x\n", opc);
-    printf("rd: %d\n", rd);
-    printf("func3: 0x%x\n", func3);
-    printf("rs1: %d\n", rs1);
-    printf("rs2: %d\n", rs2);
-    printf("func7: 0x%x\n", func7);
-    puts("");
+    if(parse_dump)
+    {
+        puts("R-Type");
+        printf("opcode: 0x%x\n", opc);
+        printf("rd: %d\n", rd);
+        printf("func3: 0x%x\n", func3);
+        printf("rs1: %d\n", rs1);
+        printf("rs2: %d\n", rs2);
+        printf("func7: 0x%x\n", func7);
+        puts("");
+    }
 
     // Construct instruction
     bin |= opc;
@@ -129,7 +303,7 @@ uint32_t parse_R_type(opcode_t *opcode, int tokc, char *tokv[])
     return bin;
 }
 
-uint32_t parse_I_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_I_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {
     immreg_t immreg;
     int ret = 0;
@@ -170,13 +344,16 @@ uint32_t parse_I_type(opcode_t *opcode, int tokc, char *tokv[])
         exit(EXIT_FAILURE);
     }
 
-    puts("I-Type");
-    printf("opcode: 0x%x\n", opc);
-    printf("rd: %u\n", rd);
-    printf("funt3: 0x%x\n", func3);
-    printf("rs1: %u\n", rs1);
-    printf("imm12: %u\n", imm12);
-    puts("");
+    if(parse_dump)
+    {
+        puts("I-Type");
+        printf("opcode: 0x%x\n", opc);
+        printf("rd: %u\n", rd);
+        printf("funt3: 0x%x\n", func3);
+        printf("rs1: %u\n", rs1);
+        printf("imm12: %u\n", imm12);
+        puts("");
+    }
 
     bin = 0;
     bin |= opc;
@@ -184,17 +361,67 @@ uint32_t parse_I_type(opcode_t *opcode, int tokc, char *tokv[])
     bin |= (func3 << 12);
     bin |= (rs1 << 15);
     bin |= (imm12 << 20);
+    // Shift immediates keep funct7 above the shift amount (srai, sraiw)
+    if((opc == 0x13 || opc == 0x1B) && (func3 == 1 || func3 == 5)) bin |= (opcode->func7 << 25);
 
     return bin;
 }
 
-uint32_t parse_S_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_S_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {
-    fputs("WARNING: S-Type not implemented yet, filling 0", stderr);
-    return 0;
+    immreg_t immreg;
+    int ttype;
+    uint32_t bin;
+    uint32_t opc = opcode->code;
+    uint32_t func3 = opcode->func3;
+    uint32_t rs1 = 0;
+    uint32_t rs2 = 0;
+    uint32_t imm12 = 0;
+
+    if(tokc != 3 || tokv == NULL || opcode == NULL)
+    {
+        fputs("ERROR: cmon man", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    ttype = get_reg_imm(tokv[1], &immreg);
+    rs2 = immreg.reg;
+
+    ttype = get_reg_imm(tokv[2], &immreg);
+    rs1 = immreg.reg;
+    if(ttype != 2)
+    {
+        fputs("ERROR: Invalid syntax for S-Type ins", stderr);
+        exit(EXIT_FAILURE);
+    }
+    imm12 = immreg.imm;
+
+    if(parse_dump)
+    {
+        puts("S-Type");
+        printf("opcode: 0x%x\n", opc);
+        printf("funt3: 0x%x\n", func3);
+        printf("rs1: %u\n", rs1);
+        printf("rs2: %u\n", rs2);
+        printf("imm12: 0x%x\n", imm12);
+        puts("");
+    }
+
+    uint32_t imm_4_0 = imm12 & 0x1F;
+    uint32_t imm_11_5 = (imm12 >> 5) & 0x7F;
+
+    bin = 0;
+    bin |= opc;
+    bin |= (imm_4_0 << 7);
+    bin |= (func3 << 12);
+    bin |= (rs1 << 15);
+    bin |= (rs2 << 20);
+    bin |= (imm_11_5 << 25);
+
+    return bin;
 }
 
-uint32_t parse_SB_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_SB_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label)
 {
     immreg_t immreg;
     int ttype;
@@ -218,16 +445,24 @@ uint32_t parse_SB_type(opcode_t *opcode, int tokc, char *tokv[])
     ttype = get_reg_imm(tokv[2], &immreg);
     rs2 = immreg.reg;
 
-    ttype = get_reg_imm(tokv[3], &immreg);
-    imm12 = immreg.imm;
+    // Label targets are filled in once every label is known
+    if(is_label_name(tokv[3].s, tokv[3].len)) *label = tokv[3];
+    else
+    {
+        ttype = get_reg_imm(tokv[3], &immreg);
+        imm12 = immreg.imm;
+    }
 
-    puts("SB-Type");
-    printf("opcode: 0x%x\n", opc);
-    printf("funt3: 0x%x\n", func3);
-    printf("rs1: %u\n", rs1);
-    printf("rs2: %u\n", rs2);
-    printf("imm12: 0x%x\n", imm12);
-    puts("");
+    if(parse_dump)
+    {
+        puts("SB-Type");
+        printf("opcode: 0x%x\n", opc);
+        printf("funt3: 0x%x\n", func3);
+        printf("rs1: %u\n", rs1);
+        printf("rs2: %u\n", rs2);
+        printf("imm12: 0x%x\n", imm12);
+        puts("");
+    }
 
     uint32_t imm_4_1 = (imm12 >> 1) & 0xF;
     uint32_t imm_10_5 = (imm12 >> 5) & 0x3F;
@@ -247,82 +482,259 @@ uint32_t parse_SB_type(opcode_t *opcode, int tokc, char *tokv[])
     return bin;
 }
 
-uint32_t parse_U_type(opcode_t *opcode, int tokc, char *tokv[])
+// lui/auipc rd, imm20 or label. lui takes the upper bits of the label's
+// address, auipc the upper bits of its offset from the instruction.
+uint32_t parse_U_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label)
 {
-    fputs("WARNING: U-Type not implemented yet, filling 0", stderr);
-    return 0;
+    immreg_t immreg;
+    uint32_t bin;
+    uint32_t opc = opcode->code;
+    uint32_t rd = 0;
+    uint32_t imm20 = 0;
+
+    if(tokc != 3 || tokv == NULL || opcode == NULL)
+    {
+        fputs("ERROR: cmon man", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if(get_reg_imm(tokv[1], &immreg) != 1)
+    {
+        fputs("ERROR: Invalid syntax for U-Type ins", stderr);
+        exit(EXIT_FAILURE);
+    }
+    rd = immreg.reg;
+
+    if(is_label_name(tokv[2].s, tokv[2].len)) *label = tokv[2];
+    else
+    {
+        get_reg_imm(tokv[2], &immreg);
+        imm20 = immreg.imm;
+    }
+
+    if(parse_dump)
+    {
+        puts("U-Type");
+        printf("opcode: 0x%x\n", opc);
+        printf("rd: %u\n", rd);
+        if(label->len) printf("imm20: %.*s\n", label->len, label->s);
+        else printf("imm20: 0x%x\n", imm20);
+        puts("");
+    }
+
+    bin = 0;
+    bin |= opc;
+    bin |= (rd << 7);
+    bin |= (imm20 & 0xFFFFF) << 12;
+
+    return bin;
 }
 
-uint32_t parse_UJ_type(opcode_t *opcode, int tokc, char *tokv[])
+// jal rd, offset or label; plain "jal target" links through x1
+uint32_t parse_UJ_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label)
 {
-    fputs("WARNING: UJ-Type not implemented yet, filling 0", stderr);
-    return 0;
+    immreg_t immreg;
+    tok_t target;
+    uint32_t bin;
+    uint32_t opc = opcode->code;
+    uint32_t rd = 1;
+    uint32_t imm = 0;
+
+    if(tokc < 2 || tokc > 3 || tokv == NULL || opcode == NULL)
+    {
+        fputs("ERROR: cmon man", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if(tokc == 3)
+    {
+        if(get_reg_imm(tokv[1], &immreg) != 1)
+        {
+            fputs("ERROR: Invalid syntax for UJ-Type ins", stderr);
+            exit(EXIT_FAILURE);
+        }
+        rd = immreg.reg;
+    }
+
+    target = tokv[tokc - 1];
+    if(is_label_name(target.s, target.len)) *label = target;
+    else
+    {
+        get_reg_imm(target, &immreg);
+        imm = immreg.imm;
+    }
+
+    if(parse_dump)
+    {
+        puts("UJ-Type");
+        printf("opcode: 0x%x\n", opc);
+        printf("rd: %u\n", rd);
+        if(label->len) printf("imm: %.*s\n", label->len, label->s);
+        else printf("imm: 0x%x\n", imm);
+        puts("");
+    }
+
+    bin = 0;
+    bin |= opc;
+    bin |= (rd << 7);
+    // Same bit scatter as a resolved label, offset from PC 0
+    if(reloc_apply(&bin, 0, (int32_t)imm))
+    {
+        fputs("ERROR: Jump offset out of range", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    return bin;
 }
 
-uint32_t parse_NULL_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_NULL_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {
     fputs("ERROR: Tried to parse NULL type. Something is very wrong", stderr);
     exit(EXIT_FAILURE);
 }
 
-int get_reg_imm(char *tok, immreg_t *dest)
+int get_reg_imm(tok_t tok, immreg_t *dest)
 {
-    char *p;
-    char *r;
-    if(tok[0] == 'x' || tok[0] == 'f') // pure reg
+    const char *p;
+    tok_t r;
+    if(isalpha((unsigned char)tok.s[0])) // pure reg
     {
         dest->reg = get_register_number(tok);
         return 1;
     }
-    else if((p = strchr(tok, '(')) != NULL) // combo
+    else if(tok.paren) // combo
     {
-        *p = '\0';
-        r = p + 1;
-        r[strlen(r) - 2] = '\0';
-        dest->imm = atoi(tok);
+        p = tok.s + tok.paren - 1;
+        if(tok.s[tok.len - 1] != ')')
+        {
+            fprintf(stderr, "Missing ) in operand: %.*s\n", tok.len, tok.s);
+            exit(EXIT_FAILURE);
+        }
+        r.s = p + 1;
+        r.len = tok.s + tok.len - 1 - r.s;
+        r.paren = 0;
+        tok.len = p - tok.s;
+        dest->imm = get_immediate(tok);
         dest->reg = get_register_number(r);
-        r[strlen(r)] = ')';
-        *p = '(';
         return 2;
     }
     else // pure imm
     {
-        dest->imm = atoi(tok);
+        dest->imm = get_immediate(tok);
         return 3;
     }
 }
 
-uint32_t get_register_number(char *reg)
+uint32_t get_register_number(tok_t reg)
 {
-    int i;
-    for(i = 0; i < NUM_OF_REGS; i++) 
+    int i = parse_register(reg.s, reg.len);
+
+    if(i == -2)
     {
-        if(strcmp(REGISTER_NAME[i], reg) == 0) break;
+        fprintf(stderr, "Register number out of range: %.*s\n", reg.len, reg.s);
+        exit(EXIT_FAILURE);
     }
-    if(i == NUM_OF_REGS)
+    if(i < 0)
     {
-        fprintf(stderr, "Failed to resolve register: %s\n", reg);
+        fprintf(stderr, "Failed to resolve register: %.*s\n", reg.len, reg.s);
         exit(EXIT_FAILURE);
     }
     return i;
 }
 
-int tokenize(char *s, char *tokv[], int maxtokv, char *delim)
+// Parse a signed decimal immediate
+int32_t get_immediate(tok_t imm)
 {
-    char *p;
-    int i = 0;
+    int64_t n = 0;
+    uint32_t i = 0;
+    bool neg = false;
 
-    tokv[i] = strtok(s, delim); 
-    while(tokv[i++] != NULL)
+    if(imm.len > 0 && (imm.s[0] == '-' || imm.s[0] == '+'))
     {
-        if(i >= maxtokv - 1){
-            tokv[i] = NULL;
-        }
-        else
+        neg = imm.s[0] == '-';
+        i++;
+    }
+    if(i == imm.len || imm.len - i > 10)
+    {
+        fprintf(stderr, "Invalid immediate: %.*s\n", imm.len, imm.s);
+        exit(EXIT_FAILURE);
+    }
+    for(; i < imm.len; i++)
+    {
+        if(imm.s[i] < '0' || imm.s[i] > '9')
         {
-            tokv[i] = strtok(NULL, delim);
+            fprintf(stderr, "Invalid immediate: %.*s\n", imm.len, imm.s);
+            exit(EXIT_FAILURE);
         }
+        n = n * 10 + (imm.s[i] - '0');
     }
-    return i - 1;
+    return neg ? -n : n;
 }
 
+// Parse the decimal register number in s[0, len), -2 if it is above max
+static int parse_register_index(const char *s, size_t len, int max)
+{
+    int n = 0;
+    size_t i;
+
+    if(len == 0 || len > 2 || (len == 2 && s[0] == '0')) return -1;
+    for(i = 0; i < len; i++)
+    {
+        if(s[i] < '0' || s[i] > '9') return -1;
+        n = n * 10 + (s[i] - '0');
+    }
+    return n <= max ? n : -2;
+}
+
+// Resolve xN, fN or an ABI register name in a single pass over its characters.
+// Returns the REGISTER_NAME index (f registers follow the x registers),
+// -1 if the name is not a register and -2 if its number is out of range.
+int parse_register(const char *reg, size_t len)
+{
+    int n;
+
+    if(len < 2) return -1;
+    switch(reg[0])
+    {
+        case 'x':
+            return parse_register_index(reg + 1, len - 1, 31);
+        case 'a': // a0-a7
+            n = parse_register_index(reg + 1, len - 1, 7);
+            return n < 0 ? n : 10 + n;
+        case 's': // s0-s11, sp
+            if(len == 2 && reg[1] == 'p') return 2;
+            n = parse_register_index(reg + 1, len - 1, 11);
+            return n < 0 ? n : n < 2 ? 8 + n : 16 + n;
+        case 't': // t0-t6, tp
+            if(len == 2 && reg[1] == 'p') return 4;
+            n = parse_register_index(reg + 1, len - 1, 6);
+            return n < 0 ? n : n < 3 ? 5 + n : 25 + n;
+        case 'r':
+            return (len == 2 && reg[1] == 'a') ? 1 : -1;
+        case 'g':
+            return (len == 2 && reg[1] == 'p') ? 3 : -1;
+        case 'z':
+            return (len == 4 && reg[1] == 'e' && reg[2] == 'r' && reg[3] == 'o') ? 0 : -1;
+        case 'f':
+            if(len == 2 && reg[1] == 'p') return 8;
+            if(reg[1] >= '0' && reg[1] <= '9')
+            {
+                n = parse_register_index(reg + 1, len - 1, 31);
+                return n < 0 ? n : 32 + n;
+            }
+            switch(reg[1])
+            {
+                case 'a': // fa0-fa7
+                    n = parse_register_index(reg + 2, len - 2, 7);
+                    return n < 0 ? n : 32 + 10 + n;
+                case 's': // fs0-fs11
+                    n = parse_register_index(reg + 2, len - 2, 11);
+                    return n < 0 ? n : 32 + (n < 2 ? 8 + n : 16 + n);
+                case 't': // ft0-ft11
+                    n = parse_register_index(reg + 2, len - 2, 11);
+                    return n < 0 ? n : 32 + (n < 8 ? n : 20 + n);
+            }
+            return -1;
+    }
+    return -1;
+}
@@ -0,0 +1,399 @@
+#include "peep.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PEEP_KEEP 0
+#define PEEP_REMOVE 1
+#define PEEP_REWRITE 2
+
+#define PEEP_OPI_ADDI 7     // opcode_map indices of what PEEP_REWRITE produces
+#define PEEP_OPI_SLLI 8
+
+// Fields of an instruction word as the rules look at them
+typedef struct
+{
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t f3;
+    uint8_t f7;
+    int32_t imm;    // I-type immediate
+} peep_ins_t;
+
+typedef struct
+{
+    uint32_t *bin;
+    uint8_t *opi;
+    uint8_t *gone;      // Removed so far
+    uint8_t *leader;    // First instruction of each basic block
+    uint64_t n;
+    uint64_t i;         // Instruction being looked at
+    uint64_t prev;      // Last instruction kept before it, n if none
+    uint64_t tail;      // Control transfer ending its basic block, or the block end
+    bool x0_zero;       // Nothing ever writes a nonzero value to x0
+    bool can_remove;    // Every code address can be recomputed
+    uint32_t word;      // Replacement for PEEP_REWRITE
+    uint8_t word_opi;   // Its opcode_map index
+} peep_ctx_t;
+
+typedef int (*peep_rule_func_t)(peep_ctx_t *c, const peep_ins_t *d);
+
+typedef struct
+{
+    const char *name;
+    peep_rule_func_t apply;
+} peep_rule_t;
+
+static int peep_stalls(peep_ctx_t *c, uint64_t i, uint32_t w);
+
+static void peep_decode(uint32_t bin, peep_ins_t *d)
+{
+    d->op = bin & 0x7F;
+    d->rd = (bin >> 7) & 0x1F;
+    d->rs1 = (bin >> 15) & 0x1F;
+    d->rs2 = (bin >> 20) & 0x1F;
+    d->f3 = (bin >> 12) & 0x7;
+    d->f7 = (bin >> 25) & 0x7F;
+    d->imm = (int32_t)bin >> 20;
+}
+
+// Register-only instructions: no memory access, no effect on control flow
+static inline int is_alu(uint8_t op)
+{
+    return op == 0x13 || op == 0x1B || op == 0x33 || op == 0x3B || op == 0x37;
+}
+
+// Writes to x0 are no-ops when nothing can ever make x0 nonzero
+static int rule_x0_write(peep_ctx_t *c, const peep_ins_t *d)
+{
+    return c->can_remove && c->x0_zero && is_alu(d->op) && d->rd == 0 ? PEEP_REMOVE : PEEP_KEEP;
+}
+
+// rd = rd op identity
+static int rule_self_move(peep_ctx_t *c, const peep_ins_t *d)
+{
+    if(!c->can_remove) return PEEP_KEEP;
+    if(d->op == 0x13 && d->rd == d->rs1)
+    {
+        switch(d->f3)
+        {
+            case 0: // addi
+            case 4: // xori
+            case 6: // ori
+                if(d->imm == 0) return PEEP_REMOVE;
+                break;
+            case 7: // andi
+                if(d->imm == -1) return PEEP_REMOVE;
+                break;
+            case 1: // slli
+            case 5: // srli, srai
+                if((d->imm & 0x3F) == 0) return PEEP_REMOVE;
+                break;
+        }
+    }
+    if(d->op == 0x33 && d->rd == d->rs1 && d->rd == d->rs2 && d->f7 == 0 && (d->f3 == 6 || d->f3 == 7))
+        return PEEP_REMOVE;
+    if(d->op == 0x33 && c->x0_zero)
+    {
+        // add, sub, sll, xor, srl, sra, or with x0 as the second operand
+        if(d->rd == d->rs1 && d->rs2 == 0 && d->f3 != 2 && d->f3 != 3 && d->f3 != 7 &&
+           (d->f7 == 0 || (d->f7 == 0x20 && (d->f3 == 0 || d->f3 == 5))))
+            return PEEP_REMOVE;
+        // add, xor, or with x0 as the first
+        if(d->rd == d->rs2 && d->rs1 == 0 && d->f7 == 0 && (d->f3 == 0 || d->f3 == 4 || d->f3 == 6))
+            return PEEP_REMOVE;
+    }
+    return PEEP_KEEP;
+}
+
+// The same word twice in a row recomputes a value rd already holds, as long
+// as rd is not one of its own operands
+static int rule_redundant(peep_ctx_t *c, const peep_ins_t *d)
+{
+    int rd, rs1, rs2;
+
+    if(!c->can_remove || c->prev == c->n || c->bin[c->prev] != c->bin[c->i] || !is_alu(d->op)) return PEEP_KEEP;
+    // The previous word has to run right before this one on every path
+    if(c->prev + 1 != c->i || c->leader[c->i]) return PEEP_KEEP;
+    ins_regs(c->bin[c->i], c->opi[c->i], &rd, &rs1, &rs2);
+    return rd != rs1 && rd != rs2 ? PEEP_REMOVE : PEEP_KEEP;
+}
+
+// rd is written again later in the block before anything reads it. The scan
+// stops at the control transfer, so it holds whether or not the delay slot
+// after it runs (it does in pipeline/, not in datapath/).
+static int rule_dead_write(peep_ctx_t *c, const peep_ins_t *d)
+{
+    int rd, rs1, rs2;
+    uint64_t j, seen;
+
+    if(!c->can_remove || !is_alu(d->op)) return PEEP_KEEP;
+    for(j = c->i + 1, seen = 0; j < c->tail && seen < PEEP_SCAN; j++)
+    {
+        if(c->gone[j]) continue;
+        seen++;
+        ins_regs(c->bin[j], c->opi[j], &rd, &rs1, &rs2);
+        if(rs1 == d->rd || rs2 == d->rd) return PEEP_KEEP;
+        if(rd == d->rd) return PEEP_REMOVE;
+    }
+    return PEEP_KEEP;
+}
+
+// Results that are always zero become 'addi rd, x0, 0', which depends on
+// nothing and so never waits on a load
+static int rule_zero_idiom(peep_ctx_t *c, const peep_ins_t *d)
+{
+    int zero = 0;
+
+    if(!c->x0_zero) return PEEP_KEEP;
+    switch(d->op)
+    {
+        case 0x33:
+        case 0x3B:
+            // sub, xor, slt, sltu, subw of a register with itself
+            if(d->rs1 == d->rs2 && ((d->f3 == 0 && d->f7 == 0x20) || (d->op == 0x33 && d->f7 == 0 && d->f3 >= 2 && d->f3 <= 4)))
+                zero = 1;
+            // and with x0, or anything of x0 with x0
+            if(d->op == 0x33 && d->f3 == 7 && d->f7 == 0 && (d->rs1 == 0 || d->rs2 == 0)) zero = 1;
+            if(d->op == 0x33 && d->rs1 == 0 && d->rs2 == 0) zero = 1;
+            // Shifts of x0
+            if(d->rs1 == 0 && (d->f3 == 1 || d->f3 == 5)) zero = 1;
+            break;
+        case 0x13:
+            if(d->f3 == 7 && d->imm == 0) zero = 1;
+            if(d->rs1 == 0 && (d->f3 == 1 || d->f3 == 5)) zero = 1;
+            if(d->rs1 == 0 && d->imm == 0 && (d->f3 == 4 || d->f3 == 6)) zero = 1;
+            break;
+    }
+    c->word = 0x13 | (uint32_t)d->rd << 7;
+    c->word_opi = PEEP_OPI_ADDI;
+    return zero && c->word != c->bin[c->i] ? PEEP_REWRITE : PEEP_KEEP;
+}
+
+// 'add rd, rs, rs' is 'slli rd, rs, 1', which reads one register instead of
+// two. Every ALU operation takes a cycle in both simulators, so this saves
+// nothing by itself, and the hazard unit reads slli's shift amount as rs2:
+// the rewrite is skipped wherever that would add a load-use stall.
+static int rule_strength(peep_ctx_t *c, const peep_ins_t *d)
+{
+    if(d->op != 0x33 || d->f3 != 0 || d->f7 != 0 || d->rs1 != d->rs2) return PEEP_KEEP;
+    c->word = 0x13 | (uint32_t)d->rd << 7 | 1 << 12 | (uint32_t)d->rs1 << 15 | 1 << 20;
+    c->word_opi = PEEP_OPI_SLLI;
+    return peep_stalls(c, c->i, c->word) <= peep_stalls(c, c->i, c->bin[c->i]) ? PEEP_REWRITE : PEEP_KEEP;
+}
+
+// Tried in order, the first rule that applies wins
+static const peep_rule_t peep_rules[] =
+{
+    { "x0-write",   &rule_x0_write },
+    { "self-move",  &rule_self_move },
+    { "redundant",  &rule_redundant },
+    { "dead-write", &rule_dead_write },
+    { "zero-idiom", &rule_zero_idiom },
+    { "strength",   &rule_strength },
+};
+
+_Static_assert(sizeof(peep_rules) / sizeof(peep_rules[0]) == PEEP_NRULES, "PEEP_NRULES is out of date");
+
+// x0 starts at zero and the simulators let it be written. It stays zero if
+// every write to it is a register operation on x0 alone with no immediate.
+static bool x0_stays_zero(const uint32_t *bin, const uint8_t *opi, uint64_t n)
+{
+    peep_ins_t d;
+    int rd, rs1, rs2;
+    uint64_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        ins_regs(bin[i], opi[i], &rd, &rs1, &rs2);
+        if(rd != 0) continue;
+        peep_decode(bin[i], &d);
+        if(d.op != 0x13 && d.op != 0x1B && d.op != 0x33 && d.op != 0x3B) return false;
+        if(rs1 > 0 || rs2 > 0) return false;
+        if((d.op == 0x13 || d.op == 0x1B) && d.imm != 0) return false;
+    }
+    return true;
+}
+
+// Removing instructions moves code, which is only safe if every use of a code
+// address is a branch or jal with a known target. auipc, jalr and lui of a
+// label all compute addresses the optimizer cannot follow.
+static bool code_can_move(ins_list_t *l, const uint32_t *bin, uint64_t n)
+{
+    uint64_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        switch(ins_opcode(bin[i]))
+        {
+            case 0x17:
+            case 0x67:
+                return false;
+            case 0x63:
+            case 0x6F:
+                if(ins_target(bin[i], i, n) < 0) return false;
+                break;
+        }
+    }
+    for(i = 0; i < l->relocs->cnt; i++)
+    {
+        if(ins_opcode(bin[l->relocs->r[i].index]) == 0x37) return false;
+    }
+    return true;
+}
+
+// Stalls around instruction i if it were word w, with prev before it
+static int peep_stalls(peep_ctx_t *c, uint64_t i, uint32_t w)
+{
+    int stalls = 0;
+
+    if(c->prev != c->n) stalls += ins_load_use(c->bin[c->prev], w);
+    if(i + 1 < c->n) stalls += ins_load_use(w, c->bin[i + 1]);
+    return stalls;
+}
+
+// Close the gaps left by removed instructions and move branch targets and
+// labels with the code
+static void peep_compact(ins_list_t *l, peep_ctx_t *c, const int64_t *target, uint64_t *newidx)
+{
+    instruction_t *ins, *last = NULL;
+    uint64_t i, k;
+    sym_t *s;
+
+    for(i = 0, k = 0; i < c->n; i++)
+    {
+        newidx[i] = k;
+        if(!c->gone[i]) k++;
+    }
+    newidx[c->n] = k;
+
+    for(i = 0; i < c->n; i++)
+    {
+        if(c->gone[i] || target[i] < 0) continue;
+        // Offsets only shrink, so they stay in range
+        reloc_apply(&c->bin[i], newidx[i] * 4, newidx[target[i]] * 4);
+    }
+    for(i = 0; i < l->syms->cap; i++)
+    {
+        s = &l->syms->tab[i];
+        if(s->name != NULL) s->addr = newidx[s->addr / 4] * 4;
+    }
+    for(i = 0; i < l->relocs->cnt; i++) l->relocs->r[i].index = newidx[l->relocs->r[i].index];
+
+    for(ins = l->head, i = 0; i < c->n; i++)
+    {
+        if(c->gone[i]) continue;
+        ins->addr = newidx[i] * 4;
+        ins->bin = c->bin[i];
+        ins->opi = c->opi[i];
+        last = ins;
+        ins = ins->next;
+    }
+    // Nodes past the new end stay in the pool until the list is deleted
+    l->tail = last;
+    if(last == NULL) l->head = NULL;
+    else last->next = NULL;
+    l->cnt = newidx[c->n];
+}
+
+static void peep_free(peep_ctx_t *c, int64_t *target, uint64_t *newidx)
+{
+    free(c->bin);
+    free(c->opi);
+    free(c->gone);
+    free(c->leader);
+    free(target);
+    free(newidx);
+}
+
+// Run the rule table over every instruction outside branch delay slots and
+// the other fixed tails of basic blocks, adding up what each rule did in st.
+// *fixed is set if code addresses are taken in ways that cannot be followed,
+// in which case instructions are only rewritten, never removed. Returns
+// nonzero if out of memory.
+int peephole_program(ins_list_t *l, peep_stats_t st[PEEP_NRULES], bool *fixed)
+{
+    peep_ctx_t c;
+    peep_ins_t d;
+    instruction_t *ins;
+    int64_t *target;
+    uint64_t *newidx;
+    uint64_t i, end;
+    int r, act, before, after;
+
+    memset(st, 0, PEEP_NRULES * sizeof(peep_stats_t));
+    for(r = 0; r < PEEP_NRULES; r++) st[r].name = peep_rules[r].name;
+
+    memset(&c, 0, sizeof(c));
+    c.n = l->cnt;
+    c.bin = malloc(c.n * sizeof(uint32_t) + 1);
+    c.opi = malloc(c.n + 1);
+    c.gone = calloc(c.n + 1, 1);
+    target = malloc((c.n + 1) * sizeof(int64_t));
+    newidx = malloc((c.n + 1) * sizeof(uint64_t));
+    if(c.bin != NULL)
+    {
+        for(ins = l->head, i = 0; ins != NULL; ins = ins->next, i++) c.bin[i] = ins->bin;
+        c.leader = ins_leaders(l, c.bin, c.n);
+    }
+    if(c.bin == NULL || c.opi == NULL || c.gone == NULL || c.leader == NULL || target == NULL || newidx == NULL)
+    {
+        peep_free(&c, target, newidx);
+        return 2;
+    }
+    for(ins = l->head, i = 0; ins != NULL; ins = ins->next, i++) c.opi[i] = ins->opi;
+    for(i = 0; i < c.n; i++) target[i] = ins_target(c.bin[i], i, c.n);
+
+    c.x0_zero = x0_stays_zero(c.bin, c.opi, c.n);
+    c.can_remove = code_can_move(l, c.bin, c.n);
+    *fixed = !c.can_remove;
+
+    c.prev = c.n;
+    for(i = 0; i < c.n; i++)
+    {
+        // Find where this block ends and where its fixed tail starts
+        if(c.leader[i])
+        {
+            for(end = i + 1; end < c.n && !c.leader[end]; end++);
+            for(c.tail = i; c.tail < end && !ins_is_barrier(c.bin[c.tail]); c.tail++);
+        }
+        if(i >= c.tail)
+        {
+            c.prev = i;
+            continue;
+        }
+
+        c.i = i;
+        peep_decode(c.bin[i], &d);
+        for(r = 0; r < PEEP_NRULES; r++)
+        {
+            act = peep_rules[r].apply(&c, &d);
+            if(act != PEEP_KEEP) break;
+        }
+
+        before = peep_stalls(&c, i, c.bin[i]);
+        if(act == PEEP_REMOVE)
+        {
+            after = c.prev != c.n && i + 1 < c.n && ins_load_use(c.bin[c.prev], c.bin[i + 1]);
+            c.gone[i] = 1;
+            st[r].removed++;
+            st[r].cycles += 1 + before - after;
+            continue;
+        }
+        if(act == PEEP_REWRITE)
+        {
+            after = peep_stalls(&c, i, c.word);
+            c.bin[i] = c.word;
+            c.opi[i] = c.word_opi;
+            st[r].rewritten++;
+            st[r].cycles += before - after;
+        }
+        c.prev = i;
+    }
+
+    peep_compact(l, &c, target, newidx);
+    peep_free(&c, target, newidx);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef __PEEP_H__
+#define __PEEP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "instruction.h"
+
+// Peephole optimizer over the assembled words, driven by the rule table in
+// peep.c. Each rule either removes an instruction or rewrites it in place;
+// removals close the gap and branch offsets, jal offsets and labels are moved
+// to match.
+#define PEEP_SCAN 64        // Instructions searched for a later overwrite
+#define PEEP_NRULES 6       // Entries in the rule table
+
+typedef struct peep_stats_s
+{
+    const char *name;
+    uint64_t removed;
+    uint64_t rewritten;
+    int64_t cycles;         // Pipeline cycles saved per pass over the code
+} peep_stats_t;
+
+int peephole_program(ins_list_t *l, peep_stats_t st[PEEP_NRULES], bool *fixed);
+
+#endif // __PEEP_H__
@@ -0,0 +1,305 @@
+#include "sched.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SCHED_MAXEDGES 7    // Dependences added per instruction, see sched_deps()
+
+// A dependence: to may not issue before from
+typedef struct
+{
+    uint16_t from;
+    uint16_t to;
+    uint8_t lat;
+} sched_edge_t;
+
+// Scratch space for one window
+typedef struct
+{
+    uint32_t bin[SCHED_WINDOW];
+    uint8_t opi[SCHED_WINDOW];
+    sched_edge_t edge[SCHED_WINDOW * SCHED_MAXEDGES];
+    uint32_t nedge;
+    uint16_t first[SCHED_WINDOW + 1];   // Successor edges of i, sorted by from
+    uint16_t succ[SCHED_WINDOW * SCHED_MAXEDGES];
+    uint8_t lat[SCHED_WINDOW * SCHED_MAXEDGES];
+    uint16_t npred[SCHED_WINDOW];
+    uint32_t height[SCHED_WINDOW];
+    uint16_t heap[SCHED_WINDOW];
+    uint16_t order[SCHED_WINDOW];
+} sched_win_t;
+
+static void sched_edge(sched_win_t *w, int from, int to, uint8_t lat)
+{
+    w->edge[w->nedge].from = from;
+    w->edge[w->nedge].to = to;
+    w->edge[w->nedge].lat = lat;
+    w->nedge++;
+}
+
+// Build the dependence graph of the n instructions in w. Every instruction
+// adds at most two RAW, one WAW and one memory edge on the forward pass and
+// two WAR and one memory edge on the backward pass. Loads keep their order
+// relative to stores and stores keep theirs, since nothing is known about
+// the addresses.
+static void sched_deps(sched_win_t *w, int n)
+{
+    int last[32], next[32];
+    int last_store = -1, next_store = -1;
+    int rd, rs[2];
+    uint32_t j;
+    int i, k;
+
+    w->nedge = 0;
+    memset(last, -1, sizeof(last));
+    for(i = 0; i < n; i++)
+    {
+        ins_regs(w->bin[i], w->opi[i], &rd, &rs[0], &rs[1]);
+        for(k = 0; k < 2; k++)
+        {
+            if(rs[k] < 0 || last[rs[k]] < 0) continue;
+            // A load's result is a cycle later than anything else's
+            sched_edge(w, last[rs[k]], i, ins_is_load(w->bin[last[rs[k]]]) ? 2 : 1);
+        }
+        if(rd >= 0 && last[rd] >= 0) sched_edge(w, last[rd], i, 1);
+        if((ins_is_load(w->bin[i]) || ins_is_store(w->bin[i])) && last_store >= 0) sched_edge(w, last_store, i, 1);
+        if(rd >= 0) last[rd] = i;
+        if(ins_is_store(w->bin[i])) last_store = i;
+    }
+
+    memset(next, -1, sizeof(next));
+    for(i = n - 1; i >= 0; i--)
+    {
+        ins_regs(w->bin[i], w->opi[i], &rd, &rs[0], &rs[1]);
+        for(k = 0; k < 2; k++)
+        {
+            if(rs[k] >= 0 && next[rs[k]] >= 0) sched_edge(w, i, next[rs[k]], 0);
+        }
+        if(ins_is_load(w->bin[i]) && next_store >= 0) sched_edge(w, i, next_store, 0);
+        if(rd >= 0) next[rd] = i;
+        if(ins_is_store(w->bin[i])) next_store = i;
+    }
+
+    // Successor lists, bucketed by source
+    memset(w->first, 0, sizeof(w->first));
+    memset(w->npred, 0, sizeof(w->npred));
+    for(j = 0; j < w->nedge; j++)
+    {
+        w->first[w->edge[j].from + 1]++;
+        w->npred[w->edge[j].to]++;
+    }
+    for(i = 0; i < n; i++) w->first[i + 1] += w->first[i];
+    for(j = 0; j < w->nedge; j++)
+    {
+        k = w->first[w->edge[j].from]++;
+        w->succ[k] = w->edge[j].to;
+        w->lat[k] = w->edge[j].lat;
+    }
+    for(i = n; i > 0; i--) w->first[i] = w->first[i - 1];
+    w->first[0] = 0;
+
+    // Longest latency path to the end of the window. Edges only point
+    // forward, so one backward sweep does it.
+    for(i = n - 1; i >= 0; i--)
+    {
+        w->height[i] = 1;
+        for(j = w->first[i]; j < w->first[i + 1]; j++)
+        {
+            if(w->lat[j] + w->height[w->succ[j]] > w->height[i]) w->height[i] = w->lat[j] + w->height[w->succ[j]];
+        }
+    }
+}
+
+// Taller first, then program order, so independent code keeps its order
+static inline int sched_before(sched_win_t *w, int a, int b)
+{
+    return w->height[a] > w->height[b] || (w->height[a] == w->height[b] && a < b);
+}
+
+static void heap_push(sched_win_t *w, int *cnt, int v)
+{
+    int i = (*cnt)++;
+
+    while(i > 0 && sched_before(w, v, w->heap[(i - 1) / 2]))
+    {
+        w->heap[i] = w->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->heap[i] = v;
+}
+
+static int heap_pop(sched_win_t *w, int *cnt)
+{
+    int top = w->heap[0];
+    int v = w->heap[--(*cnt)];
+    int i = 0, c;
+
+    while((c = 2 * i + 1) < *cnt)
+    {
+        if(c + 1 < *cnt && sched_before(w, w->heap[c + 1], w->heap[c])) c++;
+        if(!sched_before(w, w->heap[c], v)) break;
+        w->heap[i] = w->heap[c];
+        i = c;
+    }
+    w->heap[i] = v;
+    return top;
+}
+
+// Greedy list scheduling: take the tallest ready instruction that does not
+// stall behind the one placed last, looking a few candidates deep
+static void sched_list(sched_win_t *w, int n, const uint32_t *prev)
+{
+    uint16_t skipped[SCHED_LOOKAHEAD];
+    int cnt = 0, nskip, pick;
+    int i, j, k;
+
+    for(i = 0; i < n; i++)
+    {
+        if(w->npred[i] == 0) heap_push(w, &cnt, i);
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        nskip = 0;
+        pick = heap_pop(w, &cnt);
+        while(prev != NULL && ins_load_use(*prev, w->bin[pick]) && cnt > 0 && nskip < SCHED_LOOKAHEAD - 1)
+        {
+            skipped[nskip++] = pick;
+            pick = heap_pop(w, &cnt);
+        }
+        // Nothing ready avoids the stall, take the best one anyway
+        if(prev != NULL && ins_load_use(*prev, w->bin[pick]) && nskip)
+        {
+            skipped[nskip++] = pick;
+            pick = skipped[0];
+            for(k = 1; k < nskip; k++) skipped[k - 1] = skipped[k];
+            nskip--;
+        }
+        for(k = 0; k < nskip; k++) heap_push(w, &cnt, skipped[k]);
+
+        w->order[i] = pick;
+        prev = &w->bin[pick];
+        for(j = w->first[pick]; j < w->first[pick + 1]; j++)
+        {
+            if(--w->npred[w->succ[j]] == 0) heap_push(w, &cnt, w->succ[j]);
+        }
+    }
+}
+
+// Stalls in seq[0..n), with the instructions around it if there are any
+static uint64_t sched_count(const uint32_t *seq, int n, const uint32_t *prev, const uint32_t *next)
+{
+    uint64_t stalls = 0;
+    int i;
+
+    if(prev != NULL && n) stalls += ins_load_use(*prev, seq[0]);
+    for(i = 1; i < n; i++) stalls += ins_load_use(seq[i - 1], seq[i]);
+    if(next != NULL && n) stalls += ins_load_use(seq[n - 1], *next);
+    return stalls;
+}
+
+// Schedule bin/opi[lo, hi) in place. prev and next are the fixed
+// instructions on either side in the same block, NULL at its edges.
+static void sched_window(sched_win_t *w, uint32_t *bin, uint8_t *opi, uint64_t lo, uint64_t hi,
+                         const uint32_t *prev, const uint32_t *next, sched_stats_t *st)
+{
+    uint32_t nbin[SCHED_WINDOW];
+    int n = hi - lo;
+    uint64_t before, after;
+    int i;
+
+    memcpy(w->bin, bin + lo, n * sizeof(uint32_t));
+    memcpy(w->opi, opi + lo, n);
+    before = sched_count(w->bin, n, prev, next);
+    if(before == 0)
+    {
+        return;
+    }
+
+    sched_deps(w, n);
+    sched_list(w, n, prev);
+    for(i = 0; i < n; i++) nbin[i] = w->bin[w->order[i]];
+    after = sched_count(nbin, n, prev, next);
+
+    // Never make a window worse, ties keep the original order
+    if(after >= before)
+    {
+        st->before += before;
+        st->after += before;
+        return;
+    }
+    st->before += before;
+    st->after += after;
+    for(i = 0; i < n; i++)
+    {
+        if(w->order[i] != i) st->moved++;
+        bin[lo + i] = w->bin[w->order[i]];
+        opi[lo + i] = w->opi[w->order[i]];
+    }
+}
+
+// Reorder the instructions of every basic block to remove load-use stalls.
+// The control transfer ending a block and its delay slot stay at the end, and
+// so does anything after them, which keeps every branch, label and target at
+// its address. Returns nonzero if out of memory.
+int schedule_program(ins_list_t *l, sched_stats_t *st)
+{
+    instruction_t *ins;
+    sched_win_t *w;
+    uint32_t *bin;
+    uint8_t *opi, *leader;
+    uint64_t n = l->cnt, i, b, end, lo, hi;
+
+    memset(st, 0, sizeof(sched_stats_t));
+    if(n == 0) return 0;
+
+    bin = malloc(n * sizeof(uint32_t));
+    opi = malloc(n);
+    w = malloc(sizeof(sched_win_t));
+    if(bin == NULL || opi == NULL || w == NULL)
+    {
+        free(bin);
+        free(opi);
+        free(w);
+        return 2;
+    }
+    for(ins = l->head, i = 0; ins != NULL; ins = ins->next, i++)
+    {
+        bin[i] = ins->bin;
+        opi[i] = ins->opi;
+    }
+    leader = ins_leaders(l, bin, n);
+    if(leader == NULL)
+    {
+        free(bin);
+        free(opi);
+        free(w);
+        return 2;
+    }
+
+    for(i = 0; i < n; i = end)
+    {
+        for(end = i + 1; end < n && !leader[end]; end++);
+        for(b = i; b < end && !ins_is_barrier(bin[b]); b++);
+        if(b - i < 2) continue;
+
+        st->blocks++;
+        for(lo = i; lo < b; lo = hi)
+        {
+            hi = lo + SCHED_WINDOW < b ? lo + SCHED_WINDOW : b;
+            sched_window(w, bin, opi, lo, hi, lo > i ? &bin[lo - 1] : NULL,
+                         hi == b && b < end ? &bin[b] : NULL, st);
+        }
+    }
+
+    for(ins = l->head, i = 0; ins != NULL; ins = ins->next, i++)
+    {
+        ins->bin = bin[i];
+        ins->opi = opi[i];
+    }
+    free(bin);
+    free(opi);
+    free(leader);
+    free(w);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+
+#include "instruction.h"
+
+// List scheduler for the pipeline in pipeline/. Its hazard detection unit
+// stalls one cycle whenever the instruction after a load names the load's rd
+// in its rs1 or rs2 field, so within each basic block instructions are
+// reordered to put independent work after loads.
+#define SCHED_WINDOW 256    // Instructions scheduled at once within a block
+#define SCHED_LOOKAHEAD 8   // Ready instructions tried before taking a stall
+
+typedef struct sched_stats_s
+{
+    uint64_t blocks;        // Basic blocks with something to schedule
+    uint64_t moved;         // Instructions that changed position
+    uint64_t before;        // Load-use stalls in straight-line code, per block
+    uint64_t after;
+} sched_stats_t;
+
+int schedule_program(ins_list_t *l, sched_stats_t *st);
+
+#endif // __SCHED_H__
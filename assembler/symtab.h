@@ -0,0 +1,55 @@
+#ifndef __SYMTAB_H__
+#define __SYMTAB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SYMTAB_MINSZ 64     // Initial slots, always a power of two
+#define RELOC_MINSZ 64
+
+// Labels are views into the trace being assembled, like tokens, so a table
+// must not outlive the mapping its names point into
+typedef struct sym_s
+{
+    const char *name;   // NULL for an empty slot
+    uint32_t len;
+    uint64_t hash;
+    uint64_t addr;
+} sym_t;
+
+// Open-addressing hash table with linear probing, kept at most half full
+typedef struct symtab_s
+{
+    uint64_t cnt;
+    uint64_t cap;
+    sym_t *tab;
+} symtab_t;
+
+// An instruction whose immediate refers to a label
+typedef struct reloc_s
+{
+    uint64_t index;     // Instruction index, the PC is index * 4
+    const char *name;
+    uint32_t len;
+} reloc_t;
+
+// Relocations in the order they were recorded, which is instruction order
+typedef struct relocs_s
+{
+    uint64_t cnt;
+    uint64_t cap;
+    reloc_t *r;
+} relocs_t;
+
+symtab_t *symtab_init(void);
+void symtab_delete(symtab_t *t);
+int symtab_add(symtab_t *t, const char *name, uint32_t len, uint64_t addr);
+const sym_t *symtab_find(symtab_t *t, const char *name, uint32_t len);
+bool is_label_name(const char *name, uint32_t len);
+
+relocs_t *relocs_init(void);
+void relocs_delete(relocs_t *r);
+int relocs_add(relocs_t *r, uint64_t index, const char *name, uint32_t len);
+int reloc_apply(uint32_t *bin, uint64_t pc, uint64_t addr);
+
+#endif // __SYMTAB_H__
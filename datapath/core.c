@@ -1,10 +1,20 @@
 #include "core.h"
+#include "interp.h"
 #include <string.h>
 #include <stdio.h>
 
+static inline void cycle(core_t *core);
+
+// PC has left the program; waits for the loader if it has not got that far
+static inline bool past_end(core_t *core)
+{
+    return core->PC / 4 >= core->dec_mem->cnt && !d_mem_sync(core->dec_mem, core->PC / 4);
+}
+
 core_t *init_core(i_mem_t *i_mem)
 {
-    if(i_mem == NULL || i_mem->cnt == 0)
+    // Wait for the first instruction if the trace is still loading
+    if(i_mem == NULL || i_mem_wait(i_mem, 0) == 0)
     {
         fprintf(stderr, "ERROR: init_core received invalid i_mem\n");
         return NULL;
@@ -17,10 +27,19 @@ core_t *init_core(i_mem_t *i_mem)
         return NULL;
     }
     
+    core->dec_mem = d_mem_init(i_mem);
+    if (core->dec_mem == NULL)
+    {
+        fprintf(stderr, "ERROR: Failed to predecode instruction memory\n");
+        free(core);
+        return NULL;
+    }
+
     core->clk = 0;
     core->PC = 0;
     core->ins_mem = i_mem;
     core->tick = tick_func;
+    core->interp = NULL;
 
     memset(core->data_mem, 0, MEM_SIZE);
     memset(core->reg_file, 0, NUM_REGISTERS * sizeof(register_t));
@@ -28,35 +47,136 @@ core_t *init_core(i_mem_t *i_mem)
     return core;
 }
 
+void delete_core(core_t *core)
+{
+    if(core == NULL) return;
+    d_mem_delete(core->dec_mem);
+    interp_delete(core->interp);
+    free(core);
+}
+
+// Instructions are decoded once, as soon as the loader has published them,
+// since instruction memory is immutable after loading
+d_mem_t *d_mem_init(i_mem_t *i_mem)
+{
+    d_mem_t *d;
+
+    d = malloc(sizeof(d_mem_t));
+    if(d == NULL) return NULL;
+    d->mem = malloc(i_mem->cap * sizeof(decoded_t));
+    if(d->mem == NULL)
+    {
+        free(d);
+        return NULL;
+    }
+    d->cnt = 0;
+    d->src = i_mem;
+    d->done = false;
+
+    d_mem_sync(d, 0);
+    return d;
+}
+
+// Decode everything published past d->cnt, waiting for the loader if
+// instruction index is not there yet. Returns false once index is past the
+// end of the program.
+bool d_mem_sync(d_mem_t *d, uint64_t index)
+{
+    uint64_t ready, i;
+
+    if(index < d->cnt) return true;
+    if(d->done) return false;
+
+    ready = i_mem_wait(d->src, index);
+    for(i = d->cnt; i < ready; i++)
+    {
+        if(!decode(d->src->bin[i], &d->mem[i]))
+        {
+            fprintf(stderr, "ERROR: Unsupported instruction 0x%08x at PC %llu\n", d->src->bin[i],
+                    (unsigned long long)i * 4);
+            exit(EXIT_FAILURE);
+        }
+    }
+    d->cnt = ready;
+    if(index < ready) return true;
+
+    // i_mem_wait() only comes up short once loading is done
+    d->done = true;
+    return false;
+}
+
+int d_mem_delete(d_mem_t *d)
+{
+    if(d == NULL) return 1;
+    free(d->mem);
+    free(d);
+    return 0;
+}
+
+// Extract the datapath fields and control signals of one instruction word.
+// Returns false for jal, jalr, lui and auipc: they write the PC or an upper
+// immediate, which this datapath has no path for.
+bool decode(uint32_t bin, decoded_t *dec)
+{
+    memset(dec, 0, sizeof(decoded_t));
+
+    dec->bin = bin;
+    dec->opcode = bin & 0x7F;
+    dec->func3 = (bin >> 12) & 0x7;
+    dec->func7 = (dec->opcode == 0x33 || dec->opcode == 0x3B) ? (bin >> 25) & 0x7F : 0;
+    dec->imm = imm_gen(bin);
+    // Shift immediates carry funct7 in the upper immediate bits
+    if((dec->opcode == 0x13 || dec->opcode == 0x1B) && (dec->func3 == 1 || dec->func3 == 5))
+    {
+        dec->func7 = (bin >> 25) & 0x7F;
+        dec->imm &= 0x3F;
+    }
+    control_unit(dec->opcode, &dec->ctrl);
+    dec->ALU_ctrl = ALU_control_unit(dec->ctrl.ALUOp, dec->func7, dec->func3);
+
+    dec->rd_addr = (bin >> 7) & 0x1F;
+    dec->rs1_addr = (bin >> 15) & 0x1F;
+    dec->rs2_addr = (bin >> 20) & 0x1F;
+
+    return dec->opcode != 0x17 && dec->opcode != 0x37 && dec->opcode != 0x67 && dec->opcode != 0x6F;
+}
+
 bool tick_func(core_t *core)
+{
+    return core_run(core, 1) == RUN_CYCLE_LIMIT;
+}
+
+// Run up to max_cycles cycles, stopping early once the PC leaves the program
+run_status_t core_run(core_t *core, uint64_t max_cycles)
+{
+    uint64_t n;
+
+    if(past_end(core)) return RUN_HALTED;
+    for(n = 0; n < max_cycles; n++)
+    {
+        cycle(core);
+        if(past_end(core)) return RUN_HALTED;
+    }
+    return RUN_CYCLE_LIMIT;
+}
+
+// Simulate one clock cycle
+static inline void cycle(core_t *core)
 {
     // (Step 1) Instruction Fetch
-    instruction_t *ins;
-    uint32_t bin;
+    const decoded_t *dec;
 
-    ins = &core->ins_mem->mem[core->PC / 4];
-    bin = ins->bin;
+    dec = &core->dec_mem->mem[core->PC / 4];
     
     // (Step 2) Instruction Decode
-    byte_t opcode, func3, func7;
-    control_signals_t ctrl;
-    signal_t ALU_ctrl;
-    signal_t imm;
+    control_signals_t ctrl = dec->ctrl;
+    signal_t ALU_ctrl = dec->ALU_ctrl;
+    signal_t imm = dec->imm;
     signal_t input0, input1, ALU_ret, zero_ret;
     signal_t rd, rs1, rs2;
-    signal_t rd_addr, rs1_addr, rs2_addr;
-
-    opcode = bin & 0x7F;
-    func3 = (bin >> 12) & 0x7;
-    func7 = (opcode == 0x33 || opcode == 0x3B) ? (bin >> 25) & 0x7F : 0;
-
-    control_unit(opcode, &ctrl);
-    ALU_ctrl = ALU_control_unit(ctrl.ALUOp, func7, func3);
-    imm = imm_gen(bin);
-
-    rd_addr = (bin >> 7) & 0x1F;
-    rs1_addr = (bin >> 15) & 0x1F;
-    rs2_addr = (bin >> 20) & 0x1F;
+    signal_t rd_addr = dec->rd_addr;
+    signal_t rs1_addr = dec->rs1_addr;
+    signal_t rs2_addr = dec->rs2_addr;
 
     REG(core->reg_file, rs1_addr, 0, &rs1, 1, 0);
     REG(core->reg_file, rs2_addr, 0, &rs2, 1, 0);
@@ -79,9 +199,9 @@ bool tick_func(core_t *core)
 
 #if VERBOSE == 1
     printf("PC: %d\n", core->PC);
-    printf("opcode: 0x%x\n", opcode);
-    printf("func3: %d\n", func3);
-    printf("func7: %d\n", func7);
+    printf("opcode: 0x%x\n", dec->opcode);
+    printf("func3: %d\n", dec->func3);
+    printf("func7: %d\n", dec->func7);
     printf("rd: x%d\n", rd_addr);
     printf("rs1: x%d = %d\n", rs1_addr, rs1);
     printf("rs2: x%d = %d\n", rs2_addr, rs2);
@@ -107,80 +227,58 @@ bool tick_func(core_t *core)
 #endif
 
     core->clk++;
-    // Are we reaching the final instruction?
-    if (core->PC / 4 >= core->ins_mem->cnt) return false;
-    
-    return true;
 }
 
+// Control signals for each opcode in opcode_map, indexed by the 7-bit opcode.
+// Opcodes without an entry (U/UJ-type and jalr) have no control signals;
+// decode() rejects them. System instructions execute as a nop.
+static const control_signals_t control_table[128] =
+{
+    //        Branch MemRead MemtoReg ALUOp MemWrite ALUSrc RegWrite
+    [0x03] = {0,     1,      1,       0,    0,       1,     1}, // Load
+    [0x13] = {0,     0,      0,       2,    0,       1,     1}, // I-type
+    [0x1B] = {0,     0,      0,       3,    0,       1,     1}, // I-type word
+    [0x23] = {0,     0,      0,       0,    1,       1,     0}, // Store
+    [0x33] = {0,     0,      0,       2,    0,       0,     1}, // R-type
+    [0x3B] = {0,     0,      0,       3,    0,       0,     1}, // R-type word
+    [0x63] = {1,     0,      0,       1,    0,       0,     0}, // SB-type
+    [0x73] = {0,     0,      0,       0,    0,       0,     0}, // System
+};
+
+// ALU control, indexed by ALUOp, bit 5 of funct7 and funct3
+static const byte_t alu_ctrl_table[4][2][8] =
+{
+    { // ALUOp 0: loads and stores compute an address
+        {ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD},
+        {ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD},
+    },
+    { // ALUOp 1: branches compare by subtracting
+        {ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB},
+        {ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB},
+    },
+    { // ALUOp 2: R-type and I-type, decided by funct7 and funct3
+        //  000          001           010          011           100           101           110          111
+        {ALUCTRL_ADD, ALUCTRL_SLL, ALUCTRL_LT,  ALUCTRL_LTU, ALUCTRL_XOR, ALUCTRL_SRL, ALUCTRL_OR,  ALUCTRL_AND},
+        {ALUCTRL_SUB, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_SRA, ALUCTRL_INVALID, ALUCTRL_INVALID},
+    },
+    { // ALUOp 3: word R-type and I-type, 32-bit results sign-extended
+        //  000           001              010              011              100              101           110              111
+        {ALUCTRL_ADDW, ALUCTRL_SLLW,    ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_SRLW, ALUCTRL_INVALID, ALUCTRL_INVALID},
+        {ALUCTRL_SUBW, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_SRAW, ALUCTRL_INVALID, ALUCTRL_INVALID},
+    },
+};
+
 void control_unit(signal_t input, control_signals_t *signals)
 {
-    // For R-type
-    if(input == 0x33) 
-    {
-        signals->ALUSrc = 0;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 1;
-        signals->MemRead = 0;
-        signals->MemWrite = 0;
-        signals->Branch = 0;
-        signals->ALUOp = 2;
-    }
-    else if(input == 0x23) // Store instruction
-    {
-        signals->ALUSrc = 1;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 0;
-        signals->MemRead = 0;
-        signals->MemWrite = 1;
-        signals->Branch = 0;
-        signals->ALUOp = 0;
-    }
-    else if(input == 0x03) // Load instruction
-    {
-        signals->ALUSrc = 1;
-        signals->MemtoReg = 1;
-        signals->RegWrite = 1;
-        signals->MemRead = 1;
-        signals->MemWrite = 0;
-        signals->Branch = 0;
-        signals->ALUOp = 0;
-    }
-    else if(input == 0x13) // I-Type
-    {
-        signals->ALUSrc = 1;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 1;
-        signals->MemRead = 0;
-        signals->MemWrite = 0;
-        signals->Branch = 0;
-        signals->ALUOp = 2; 
-    }
-    else if(input == 0x63) // SB type
-    {
-        signals->ALUSrc = 0;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 0;
-        signals->MemRead = 0;
-        signals->MemWrite = 0;
-        signals->Branch = 1;
-        signals->ALUOp = 1;
-    }
+    *signals = control_table[input & 0x7F];
 }
 
 signal_t ALU_control_unit(signal_t ALUOp, signal_t Funct7, signal_t Funct3)
 {
-    if(ALUOp == 0) return ALUCTRL_ADD;
-    if(ALUOp == 1) return ALUCTRL_SUB;
-    if(ALUOp == 2)
-    {
-        if(Funct7 == 0 && Funct3 == 0)  return ALUCTRL_ADD;
-        if(Funct7 == 0 && Funct3 == 1)  return ALUCTRL_SLL;
-        if(Funct7 == 0 && Funct3 == 7) return ALUCTRL_AND;
-        if(Funct7 == 0 && Funct3 == 6) return ALUCTRL_OR;
-        if(Funct7 == 0x20 && Funct3 == 0) return ALUCTRL_SUB;
-    }
-    fputs("ALU Control Unit failed to parse signal\n", stderr); 
+    byte_t ALU_ctrl = alu_ctrl_table[ALUOp & 0x3][(Funct7 >> 5) & 0x1][Funct3 & 0x7];
+
+    if(ALU_ctrl == ALUCTRL_INVALID) fputs("ALU Control Unit failed to parse signal\n", stderr); 
+    return ALU_ctrl;
 }
 
 signal_t imm_gen(signal_t input)
@@ -189,7 +287,7 @@ signal_t imm_gen(signal_t input)
     byte_t opcode = input & 0x7F;
 
     if(opcode == 0x33 || opcode == 0x3B) return 0;
-    if(opcode == 0x03 || opcode == 0x13)
+    if(opcode == 0x03 || opcode == 0x13 || opcode == 0x1B || opcode == 0x67 || opcode == 0x73)
     {
         im = input >> 20;
         if(im & (1 << 11)) im |= ~(0xFFF);
@@ -215,6 +313,28 @@ signal_t imm_gen(signal_t input)
         im |= i_12 ? ~(0x1FFF) : 0;
         return im;
     }
+    // U-Type
+    if(opcode == 0x17 || opcode == 0x37)
+    {
+        im = input & 0xFFFFF000;
+        if(im & (1L << 31)) im |= ~(0xFFFFFFFFL);
+        return im;
+    }
+    // UJ-Type
+    if(opcode == 0x6F)
+    {
+        signal_t i_20 = (input >> 31) & 0x1;
+        signal_t i_19_12 = (input >> 12) & 0xFF;
+        signal_t i_11 = (input >> 20) & 0x1;
+        signal_t i_10_1 = (input >> 21) & 0x3FF;
+
+        im |= i_20 << 20;
+        im |= i_19_12 << 12;
+        im |= i_11 << 11;
+        im |= i_10_1 << 1;
+        im |= i_20 ? ~(0x1FFFFF) : 0;
+        return im;
+    }
     puts("BOY WHAT THE HEEEELLLLLLL");
     return 0;
 }
@@ -241,11 +361,38 @@ void ALU(signal_t input_0, signal_t input_1, signal_t ALU_ctrl_signal, signal_t
         case ALUCTRL_SUB:
             *ALU_result = input_0 - input_1;
             break;
+        case ALUCTRL_LT:
+            *ALU_result = input_0 < input_1;
+            break;
+        case ALUCTRL_LTU:
+            *ALU_result = (uint64_t)input_0 < (uint64_t)input_1;
+            break;
+        case ALUCTRL_XOR:
+            *ALU_result = input_0 ^ input_1;
+            break;
         case ALUCTRL_SRL:
-            *ALU_result = input_0 >> input_1;
+            *ALU_result = (uint64_t)input_0 >> (input_1 & 0x3F);
+            break;
+        case ALUCTRL_SRA:
+            *ALU_result = input_0 >> (input_1 & 0x3F);
             break;
         case ALUCTRL_SLL:
-            *ALU_result = input_0 << input_1;
+            *ALU_result = (uint64_t)input_0 << (input_1 & 0x3F);
+            break;
+        case ALUCTRL_ADDW:
+            *ALU_result = (int32_t)((uint64_t)input_0 + (uint64_t)input_1);
+            break;
+        case ALUCTRL_SUBW:
+            *ALU_result = (int32_t)((uint64_t)input_0 - (uint64_t)input_1);
+            break;
+        case ALUCTRL_SLLW:
+            *ALU_result = (int32_t)((uint32_t)input_0 << (input_1 & 0x1F));
+            break;
+        case ALUCTRL_SRLW:
+            *ALU_result = (int32_t)((uint32_t)input_0 >> (input_1 & 0x1F));
+            break;
+        case ALUCTRL_SRAW:
+            *ALU_result = (int32_t)input_0 >> (input_1 & 0x1F);
             break;
         default:
             fputs("ERROR: Unrecognized ALUCTRL\n", stderr);
@@ -255,6 +402,14 @@ void ALU(signal_t input_0, signal_t input_1, signal_t ALU_ctrl_signal, signal_t
     *zero = *ALU_result == 0;
 }
 
+// Stop on a load or store outside data memory. Loads read one byte and
+// stores write four, so the last address either may use differs.
+void mem_fault(signal_t addr)
+{
+    fprintf(stderr, "ERROR: Data memory access out of range at address %lld\n", (long long)addr);
+    exit(EXIT_FAILURE);
+}
+
 // Perform read and write memory operations
 void MEM(byte_t data_mem[], signal_t addr, signal_t data_in, signal_t *data_out, signal_t read, signal_t write)
 {
@@ -263,10 +418,11 @@ void MEM(byte_t data_mem[], signal_t addr, signal_t data_in, signal_t *data_out,
         fputs("ERROR: MEM received a NULL pointer\n", stderr);
         exit(EXIT_FAILURE);
     }
+    if((read && (uint64_t)addr > MEM_SIZE - 1) || (write && (uint64_t)addr > MEM_SIZE - 4)) mem_fault(addr);
 
     if(read && data_out)
     {
-        uint32_t out;
+        uint32_t out = 0;
         memcpy(&out, &data_mem[addr], 1);
         *data_out = out;
     }
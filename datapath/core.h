@@ -14,45 +14,94 @@ typedef uint8_t byte_t;
 typedef int64_t signal_t;
 typedef int64_t register_t;
 
+#define CORE_RUN_FOREVER UINT64_MAX // No cycle limit for core_run()
+
 typedef struct core_s core_t;
+typedef enum run_status_e run_status_t;
 typedef enum aluctrl_e aluctrl_t;
 
+// Why core_run() returned
+enum run_status_e
+{
+    RUN_HALTED,      // The program has finished
+    RUN_CYCLE_LIMIT  // max_cycles elapsed first
+};
+
 enum aluctrl_e
 {
     ALUCTRL_AND = 0,  // 0000
     ALUCTRL_OR,       // 0001
     ALUCTRL_ADD,      // 0010
-    ALUCTRL_SUB = 6,  // 0110
+    ALUCTRL_LTU,      // 0011
+    ALUCTRL_ADDW,     // 0100
+    ALUCTRL_SUBW,     // 0101
+    ALUCTRL_SUB,      // 0110
     ALUCTRL_LT,       // 0111
     ALUCTRL_SRL,      // 1000
     ALUCTRL_SLL,      // 1001
-    ALUCTRL_SRA = 10, // 1010
-    ALUCTRL_XOR = 13  // 1101
+    ALUCTRL_SRA,      // 1010
+    ALUCTRL_SLLW,     // 1011
+    ALUCTRL_SRLW,     // 1100
+    ALUCTRL_XOR,      // 1101
+    ALUCTRL_SRAW,     // 1110
+    ALUCTRL_INVALID   // 1111
 };
 
+// Definition of the various control signals, packed into a single byte
+typedef struct control_signals_s {
+    uint8_t Branch   : 1;
+    uint8_t MemRead  : 1;
+    uint8_t MemtoReg : 1;
+    uint8_t ALUOp    : 2;
+    uint8_t MemWrite : 1;
+    uint8_t ALUSrc   : 1;
+    uint8_t RegWrite : 1;
+} control_signals_t;
+
+// Instruction predecoded once at load time so the datapath does not re-decode every cycle
+typedef struct decoded_s
+{
+    register_t imm;
+    uint32_t bin;
+    control_signals_t ctrl;
+    byte_t ALU_ctrl;
+    byte_t opcode;
+    byte_t func3;
+    byte_t func7;
+    byte_t rd_addr;
+    byte_t rs1_addr;
+    byte_t rs2_addr;
+} decoded_t;
+
+// Predecoded instruction memory, indexed by PC / 4 like i_mem_t
+typedef struct d_mem_s
+{
+    uint64_t cnt;       // Instructions decoded so far
+    decoded_t *mem;
+    i_mem_t *src;       // Instruction memory being decoded
+    bool done;          // cnt covers the whole program
+} d_mem_t;
+
 // Definition of the RISC-V core
 struct core_s {
     tick_t clk;                         // Core clock
     addr_t PC;                          // Program counter
     i_mem_t *ins_mem;                   // Instruction memory 
+    d_mem_t *dec_mem;                   // Predecoded instruction memory
     byte_t data_mem[MEM_SIZE];          // Data memory
     register_t reg_file[NUM_REGISTERS]; // Register file.
     bool (*tick)(struct core_s *core);  // Simulate function 
+    struct interp_s *interp;            // Threaded code for interp_run(), built on first use
 };
 
-// Definition of the various control signals
-typedef struct control_signals_s {
-    signal_t Branch;
-    signal_t MemRead;
-    signal_t MemtoReg;
-    signal_t ALUOp;
-    signal_t MemWrite;
-    signal_t ALUSrc;
-    signal_t RegWrite;
-} control_signals_t;
-
 core_t *init_core(i_mem_t *i_mem);
+void delete_core(core_t *core);
+d_mem_t *d_mem_init(i_mem_t *i_mem);
+int d_mem_delete(d_mem_t *d);
+bool d_mem_sync(d_mem_t *d, uint64_t index);
+bool decode(uint32_t bin, decoded_t *dec);
 bool tick_func(core_t *core);
+run_status_t core_run(core_t *core, uint64_t max_cycles);
 void print_core_state(core_t *core);
 void print_data_memory(core_t *core, unsigned int start, unsigned int end);
 
@@ -63,6 +112,7 @@ signal_t imm_gen(signal_t input);
 void ALU(signal_t input_0, signal_t input_1, signal_t ALU_ctrl_signal, signal_t *ALU_result, signal_t *zero);
 
 void MEM(byte_t data_mem[], signal_t addr, signal_t data_in, signal_t *data_out, signal_t read, signal_t write);
+void mem_fault(signal_t addr);
 void REG(register_t reg_file[], signal_t addr, register_t data_in, register_t *data_out, signal_t read, signal_t write);
 
 signal_t MUX(signal_t sel, signal_t input_0, signal_t input_1);
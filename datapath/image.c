@@ -0,0 +1,144 @@
+#include "image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void image_corrupt(const char *path, const char *why)
+{
+    fprintf(stderr, "ERROR: Corrupt image file %s: %s\n", path, why);
+    exit(EXIT_FAILURE);
+}
+
+// Check that a section of n bytes at off lies inside an image of size bytes
+static int image_section_ok(uint64_t off, uint64_t n, uint64_t size)
+{
+    return off % 8 == 0 && off <= size && n <= size - off;
+}
+
+// opcode_map index of an instruction word, for images without an opi section
+static uint8_t image_opcode_index(uint32_t bin)
+{
+    uint8_t code = bin & 0x7F;
+    uint8_t func3 = (bin >> 12) & 0x7;
+    uint8_t func7 = (bin >> 25) & 0x7F;
+    int i;
+
+    for(i = 0; i < NOPS; i++)
+    {
+        if(opcode_map[i].code != code) continue;
+        switch(opcode_map[i].type)
+        {
+            case R_TYPE:
+                if(opcode_map[i].func3 == func3 && opcode_map[i].func7 == func7) return i;
+                break;
+            case I_TYPE:
+                // Shift immediates are told apart by funct7, less shamt[5]
+                if(opcode_map[i].func3 == func3 &&
+                   (!((code == 0x13 || code == 0x1B) && (func3 == 1 || func3 == 5)) ||
+                    opcode_map[i].func7 == (func7 & 0x7E))) return i;
+                break;
+            case S_TYPE:
+            case SB_TYPE:
+                if(opcode_map[i].func3 == func3) return i;
+                break;
+            default:
+                return i;
+        }
+    }
+    fprintf(stderr, "ERROR: Unknown instruction word in image: 0x%08x\n", bin);
+    exit(EXIT_FAILURE);
+}
+
+// Load a binary image written by 'assembler -o'. The text and opi sections are
+// used in place from a read-only mapping of the file. Returns NULL, without
+// printing anything, if path is not an image so the caller can treat it as a
+// trace.
+i_mem_t *image_load(const char *path)
+{
+    image_hdr_t hdr;
+    struct stat st;
+    uint64_t cnt, text_off, opi_off, sym_off, sym_cnt, size, i;
+    image_sym_t sym;
+    uint32_t *bin;
+    i_mem_t *m;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr) ||
+       pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+       memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)))
+    {
+        close(fd);
+        return NULL;
+    }
+    printf("Loading image file: %s\n\n", path);
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    fputs("ERROR: Binary images can only be mapped on little-endian hosts\n", stderr);
+    exit(EXIT_FAILURE);
+#endif
+
+    size = st.st_size;
+    cnt = le64toh(hdr.cnt);
+    text_off = le64toh(hdr.text_off);
+    opi_off = le64toh(hdr.opi_off);
+    sym_off = le64toh(hdr.sym_off);
+    sym_cnt = le64toh(hdr.sym_cnt);
+    if(le32toh(hdr.version) != IMAGE_VERSION) image_corrupt(path, "unsupported version");
+    if(cnt > IMEM_MAXSZ) image_corrupt(path, "too many instructions");
+    if(!image_section_ok(text_off, cnt * 4, size)) image_corrupt(path, "bad text section");
+    if(opi_off && !image_section_ok(opi_off, cnt, size)) image_corrupt(path, "bad opi section");
+    if(sym_off && (!image_section_ok(sym_off, 0, size) || sym_cnt > (size - sym_off) / sizeof(sym)))
+        image_corrupt(path, "bad symbol section");
+
+    // Labels are only kept for tools reading the image, but check their names
+    // lie inside the file
+    for(i = 0; sym_off && i < sym_cnt; i++)
+    {
+        if(pread(fd, &sym, sizeof(sym), sym_off + i * sizeof(sym)) != sizeof(sym) ||
+           le32toh(sym.name_off) > size - sym_off ||
+           le32toh(sym.name_len) > size - sym_off - le32toh(sym.name_off))
+            image_corrupt(path, "bad symbol entry");
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        perror("Cannot map image file. \n");
+        exit(EXIT_FAILURE);
+    }
+    bin = (uint32_t *)(map + text_off);
+
+    if(opi_off)
+    {
+        m = i_mem_map(map, size, bin, (uint8_t *)(map + opi_off), cnt);
+    }
+    else
+    {
+        // No predecoded section, rebuild the indices in a normal instruction memory
+        m = i_mem_init();
+        if(m != NULL && i_mem_reserve(m, cnt)) m = NULL;
+        for(i = 0; m != NULL && i < cnt; i++)
+        {
+            if(i_mem_add(m, bin[i], image_opcode_index(bin[i]))) m = NULL;
+        }
+        if(m != NULL) i_mem_publish(m, m->cnt, true);
+        munmap(map, size);
+    }
+
+    if(m == NULL)
+    {
+        fputs("ERROR: Failed to initialize instruction memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    return m;
+}
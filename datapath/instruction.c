@@ -1,37 +1,170 @@
+
 #include "instruction.h"
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Move instruction memory into a new arena holding cap instructions
+static int i_mem_resize(i_mem_t *m, uint64_t cap)
+{
+    uint32_t *bin;
+    uint8_t *opi;
+
+    // A mapped image cannot grow
+    if(m->map != NULL) return 2;
+
+    bin = malloc(cap * (sizeof(uint32_t) + sizeof(uint8_t)));
+    if(bin == NULL) return 2;
+    opi = (uint8_t *)(bin + cap);
+
+    if(m->cnt)
+    {
+        memcpy(bin, m->bin, m->cnt * sizeof(uint32_t));
+        memcpy(opi, m->opi, m->cnt * sizeof(uint8_t));
+    }
+    free(m->bin);
+
+    m->bin = bin;
+    m->opi = opi;
+    m->cap = cap;
+    return 0;
+}
 
 i_mem_t *i_mem_init()
 {
     i_mem_t *m;
     m = malloc(sizeof(i_mem_t));
     if(m == NULL) return NULL;
-    m->cnt= 0;
+    m->cnt = 0;
+    m->bin = NULL;
+    m->map = NULL;
+    m->map_size = 0;
+    if(i_mem_resize(m, IMEMSZ))
+    {
+        free(m);
+        return NULL;
+    }
+    m->ready = 0;
+    m->done = false;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+
+    return m;
+}
+
+// Instruction memory backed by a mapped image: bin and opi point into map,
+// which is unmapped by i_mem_delete()
+i_mem_t *i_mem_map(void *map, size_t size, uint32_t *bin, uint8_t *opi, uint64_t cnt)
+{
+    i_mem_t *m;
+    m = malloc(sizeof(i_mem_t));
+    if(m == NULL) return NULL;
+    m->cnt = cnt;
+    m->cap = cnt;
+    m->bin = bin;
+    m->opi = opi;
+    m->map = map;
+    m->map_size = size;
+    m->ready = cnt;
+    m->done = true;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+
+    return m;
 }
 
 int i_mem_delete(i_mem_t *m)
 {
     if(m == NULL) return 1;
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->cond);
+    if(m->map != NULL) munmap(m->map, m->map_size);
+    else free(m->bin);
     free(m);
     return 0;
 }
 
-int i_mem_add(i_mem_t *m, uint64_t addr, uint32_t bin, opcode_t *opc)
+int i_mem_add(i_mem_t *m, uint32_t bin, uint8_t opi)
 {
-    instruction_t *i;
     uint64_t index;
 
-    if(m == NULL || opc == NULL) return 1;
+    if(m == NULL || opi >= NOPS) return 1;
 
     index = m->cnt;
-    if(index >= IMEMSZ) return 1;
+    if(index >= m->cap)
+    {
+        // Double the capacity, up to IMEM_MAXSZ
+        if(m->cap >= IMEM_MAXSZ) return 2;
+        if(i_mem_resize(m, m->cap * 2 > IMEM_MAXSZ ? IMEM_MAXSZ : m->cap * 2)) return 2;
+    }
 
-    i = &m->mem[index];
-    i->addr = addr;
-    i->bin = bin;
-    i->opc = *opc;
+    m->bin[index] = bin;
+    m->opi[index] = opi;
     m->cnt++;
 
     return 0;
 }
 
+// Append all of src to the end of m
+int i_mem_append(i_mem_t *m, const i_mem_t *src)
+{
+    uint64_t cap;
+
+    if(m == NULL || src == NULL) return 1;
+    if(src->cnt > IMEM_MAXSZ - m->cnt) return 2;
+
+    if(m->cnt + src->cnt > m->cap)
+    {
+        for(cap = m->cap; cap < m->cnt + src->cnt; cap *= 2);
+        if(i_mem_resize(m, cap > IMEM_MAXSZ ? IMEM_MAXSZ : cap)) return 2;
+    }
+
+    memcpy(m->bin + m->cnt, src->bin, src->cnt * sizeof(uint32_t));
+    memcpy(m->opi + m->cnt, src->opi, src->cnt * sizeof(uint8_t));
+    m->cnt += src->cnt;
+
+    return 0;
+}
+
+// Grow instruction memory to hold at least cap instructions. A streaming
+// loader reserves everything up front so the arrays never move under the core.
+int i_mem_reserve(i_mem_t *m, uint64_t cap)
+{
+    if(m == NULL) return 1;
+    if(cap > IMEM_MAXSZ) return 2;
+    if(cap <= m->cap) return 0;
+    return i_mem_resize(m, cap) ? 2 : 0;
+}
+
+// Make instructions [0, ready) visible to i_mem_wait(), and mark the end of
+// the program if done
+void i_mem_publish(i_mem_t *m, uint64_t ready, bool done)
+{
+    pthread_mutex_lock(&m->lock);
+    __atomic_store_n(&m->ready, ready, __ATOMIC_RELEASE);
+    m->done = done;
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+}
+
+// Block until instruction index has been published or loading is done.
+// Returns the number of instructions that may be fetched.
+uint64_t i_mem_wait(i_mem_t *m, uint64_t index)
+{
+    uint64_t ready = __atomic_load_n(&m->ready, __ATOMIC_ACQUIRE);
+
+    if(ready > index) return ready;
+
+    pthread_mutex_lock(&m->lock);
+    while(m->ready <= index && !m->done) pthread_cond_wait(&m->cond, &m->lock);
+    ready = m->ready;
+    pthread_mutex_unlock(&m->lock);
+    return ready;
+}
+
+const opcode_t *i_mem_opcode(i_mem_t *m, uint64_t index)
+{
+    // Indices read from an image are not validated when it is mapped
+    if(m == NULL || index >= m->cnt || m->opi[index] >= NOPS) return NULL;
+    return &opcode_map[m->opi[index]];
+}
@@ -2,15 +2,17 @@
 #define __INSTRUCTION_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
-#define IMEMSZ 512
+#define IMEMSZ 512                  // Initial instruction memory capacity
+#define IMEM_MAXSZ (1ULL << 30)     // Instruction memory limit, in instructions
 #define NOPS 57
 
 typedef uint64_t tick_t;
 typedef uint64_t addr_t;
 typedef enum ins_type_e ins_type_t;
 typedef struct opcode_s opcode_t;
-typedef struct instruction_s instruction_t;
 typedef struct ins_list_s ins_list_t;
 typedef struct i_mem_s i_mem_t;
 
@@ -34,22 +36,36 @@ struct opcode_s
     uint8_t func7;
 };
 
-struct instruction_s 
-{
-    uint64_t addr;
-    uint32_t bin;
-    opcode_t opc;
-};
-
+// Instruction memory is stored as a structure of arrays carved from a single
+// arena that doubles in size when full. Fetch only touches the dense word
+// array; the opcode_map index of each instruction is kept apart for printing
+// and debugging.
 struct i_mem_s
 {
     uint64_t cnt;
-    instruction_t mem[IMEMSZ];
+    uint64_t cap;
+    uint32_t *bin;  // Instruction words, indexed by PC / 4
+    uint8_t *opi;   // opcode_map index of each instruction
+    void *map;      // Image file the arrays point into, NULL for the arena
+    size_t map_size;
+
+    // A loader running on another thread publishes how far it has got;
+    // see i_mem_publish() and i_mem_wait()
+    uint64_t ready;             // Instructions [0, ready) may be fetched
+    bool done;                  // Loading is finished, ready is final
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
 i_mem_t *i_mem_init();
+i_mem_t *i_mem_map(void *map, size_t size, uint32_t *bin, uint8_t *opi, uint64_t cnt);
 int i_mem_delete(i_mem_t *m);
-int i_mem_add(i_mem_t *m, uint64_t addr, uint32_t bin, opcode_t *opc);
+int i_mem_add(i_mem_t *m, uint32_t bin, uint8_t opi);
+int i_mem_append(i_mem_t *m, const i_mem_t *src);
+int i_mem_reserve(i_mem_t *m, uint64_t cap);
+void i_mem_publish(i_mem_t *m, uint64_t ready, bool done);
+uint64_t i_mem_wait(i_mem_t *m, uint64_t index);
+const opcode_t *i_mem_opcode(i_mem_t *m, uint64_t index);
 
 static opcode_t opcode_map[NOPS] =
 {
@@ -72,8 +88,8 @@ static opcode_t opcode_map[NOPS] =
     {"auipc",  0x17, U_TYPE,  0x0, 0x00},
     {"addiw",  0x1B, I_TYPE,  0x0, 0x00},
     {"slliw",  0x1B, I_TYPE,  0x1, 0x00},
-    {"srliw",  0x1B, I_TYPE,  0x3, 0x00},
-    {"sraiw",  0x1B, I_TYPE,  0x3, 0x20},
+    {"srliw",  0x1B, I_TYPE,  0x5, 0x00},
+    {"sraiw",  0x1B, I_TYPE,  0x5, 0x20},
     {"sb",     0x23, S_TYPE,  0x0, 0x00},
     {"sh",     0x23, S_TYPE,  0x1, 0x00},
     {"sw",     0x23, S_TYPE,  0x2, 0x00},
@@ -112,5 +128,82 @@ static opcode_t opcode_map[NOPS] =
     {"CSRRCI", 0x73, I_TYPE,  0x7, 0x00},
 };
 
+// Perfect hash over the mnemonics in opcode_map. A mnemonic is packed
+// little-endian into a 64-bit key and MNEMONIC_HASH() maps every key in the
+// table to its own slot, so a lookup is one multiply and one key compare.
+// MNEMONIC_HASH_MUL was found by an offline search; adding an instruction to
+// opcode_map means regenerating this table (and possibly the multiplier).
+#define MNEMONIC_MAXLEN 8
+#define MNEMONIC_HASH_BITS 7
+#define MNEMONIC_HASH_MUL 0x5482b5fc9782ebd1ULL
+#define MNEMONIC_HASH(key) (((key) * MNEMONIC_HASH_MUL) >> (64 - MNEMONIC_HASH_BITS))
+
+typedef struct
+{
+    uint64_t key;
+    uint8_t opi;
+} mnemonic_slot_t;
+
+static const mnemonic_slot_t mnemonic_table[1 << MNEMONIC_HASH_BITS] =
+{
+    [  0] = {0x000000006273, 21}, // sb
+    [  1] = {0x000075746c73, 29}, // sltu
+    [  2] = {0x000000006473, 24}, // sd
+    [  4] = {0x00000069756c, 35}, // lui
+    [  8] = {0x000000006873, 22}, // sh
+    [ 16] = {0x000000617273, 32}, // sra
+    [ 19] = {0x495352525343, 55}, // CSRRSI
+    [ 20] = {0x007769617273, 20}, // sraiw
+    [ 21] = {0x000000646461, 25}, // add
+    [ 22] = {0x000069746c73,  9}, // slti
+    [ 23] = {0x000075656762, 46}, // bgeu
+    [ 24] = {0x005752525343, 51}, // CSRRW
+    [ 25] = {0x007769646461, 17}, // addiw
+    [ 26] = {0x6b6165726265, 50}, // ebreak
+    [ 32] = {0x000000716562, 41}, // beq
+    [ 35] = {0x000000646e61, 34}, // and
+    [ 37] = {0x0000006c616a, 48}, // jal
+    [ 38] = {0x0000776c6c73, 38}, // sllw
+    [ 40] = {0x000000656e62, 42}, // bne
+    [ 41] = {0x006c6c616365, 49}, // ecall
+    [ 42] = {0x000000726f78, 30}, // xor
+    [ 44] = {0x004352525343, 53}, // CSRRC
+    [ 46] = {0x0000776c7273, 39}, // srlw
+    [ 47] = {0x000000627573, 26}, // sub
+    [ 51] = {0x000075746c62, 45}, // bltu
+    [ 52] = {0x00000000776c,  2}, // lw
+    [ 53] = {0x007569746c73, 10}, // sltiu
+    [ 62] = {0x0000696c6c73,  8}, // slli
+    [ 63] = {0x00000069726f, 14}, // ori
+    [ 64] = {0x006370697561, 16}, // auipc
+    [ 66] = {0x495752525343, 54}, // CSRRWI
+    [ 69] = {0x000077617273, 40}, // sraw
+    [ 70] = {0x0000696c7273, 12}, // srli
+    [ 72] = {0x000000746c73, 28}, // slt
+    [ 74] = {0x000077646461, 36}, // addw
+    [ 75] = {0x00000075776c,  6}, // lwu
+    [ 87] = {0x494352525343, 56}, // CSRRCI
+    [ 88] = {0x00000000626c,  0}, // lb
+    [ 91] = {0x00000000646c,  3}, // ld
+    [ 92] = {0x000000007773, 23}, // sw
+    [ 93] = {0x000069617273, 13}, // srai
+    [ 94] = {0x000000656762, 44}, // bge
+    [ 96] = {0x00000000686c,  1}, // lh
+    [ 98] = {0x000069646461,  7}, // addi
+    [ 99] = {0x0000726c616a, 47}, // jalr
+    [100] = {0x000077627573, 37}, // subw
+    [105] = {0x005352525343, 52}, // CSRRS
+    [108] = {0x00000000726f, 33}, // or
+    [110] = {0x00000075626c,  4}, // lbu
+    [112] = {0x000069646e61, 15}, // andi
+    [113] = {0x0000006c6c73, 27}, // sll
+    [117] = {0x0077696c6c73, 18}, // slliw
+    [118] = {0x00000075686c,  5}, // lhu
+    [119] = {0x000069726f78, 11}, // xori
+    [121] = {0x0000006c7273, 31}, // srl
+    [122] = {0x000000746c62, 43}, // blt
+    [125] = {0x0077696c7273, 19}, // srliw
+};
+
 #endif // __INSTRUCTION_H__
 
@@ -0,0 +1,430 @@
+#include "interp.h"
+#include "jit.h"
+
+#include <string.h>
+#include <stdio.h>
+
+// Direct threading needs the labels-as-values extension
+#if defined(__GNUC__) && !INTERP_SWITCH
+#define INTERP_THREADED 1
+#else
+#define INTERP_THREADED 0
+#endif
+
+static const void *const *handlers = NULL;
+
+static run_status_t interp_exec(core_t *core, interp_t *t, uint64_t max_cycles);
+
+// Handler for an R-type or I-type ALU operation, or FAST_SLOW if the ALU
+// control is one the handlers do not implement
+static byte_t fast_alu_op(byte_t ALU_ctrl, bool imm)
+{
+    byte_t op;
+
+    switch(ALU_ctrl)
+    {
+        case ALUCTRL_AND: op = FAST_AND; break;
+        case ALUCTRL_OR:  op = FAST_OR;  break;
+        case ALUCTRL_ADD: op = FAST_ADD; break;
+        case ALUCTRL_LTU: op = FAST_LTU; break;
+        case ALUCTRL_SUB: op = FAST_SUB; break;
+        case ALUCTRL_LT:  op = FAST_LT;  break;
+        case ALUCTRL_SRL: op = FAST_SRL; break;
+        case ALUCTRL_SLL: op = FAST_SLL; break;
+        case ALUCTRL_SRA: op = FAST_SRA; break;
+        case ALUCTRL_XOR: op = FAST_XOR; break;
+        default: return FAST_SLOW;
+    }
+    return imm ? op + (FAST_ADDI - FAST_ADD) : op;
+}
+
+// Pick the handler for instruction i from its control signals, so it does
+// exactly what cycle() would with them. A branch to a target off the
+// instruction grid or past the end goes through the datapath, which leaves the
+// PC wherever the branch put it.
+static void fast_translate(const decoded_t *d, uint64_t i, uint64_t cnt, fast_ins_t *f)
+{
+    control_signals_t c = d->ctrl;
+
+    f->rd = d->rd_addr;
+    f->rs1 = d->rs1_addr;
+    f->rs2 = d->rs2_addr;
+    f->imm = d->imm;
+
+    if(c.Branch)
+    {
+        f->op = d->ALU_ctrl == ALUCTRL_SUB && !c.RegWrite && !c.MemRead && !c.MemWrite && !c.ALUSrc &&
+                !(d->imm & 3) && (addr_t)(i * 4 + d->imm) / 4 <= cnt ? FAST_BEQ : FAST_SLOW;
+    }
+    else if(c.MemRead)
+    {
+        f->op = d->ALU_ctrl == ALUCTRL_ADD && c.ALUSrc && c.MemtoReg && c.RegWrite && !c.MemWrite ?
+                FAST_LOAD : FAST_SLOW;
+    }
+    else if(c.MemWrite)
+    {
+        f->op = d->ALU_ctrl == ALUCTRL_ADD && c.ALUSrc && !c.RegWrite ? FAST_STORE : FAST_SLOW;
+    }
+    else if(c.RegWrite)
+    {
+        f->op = c.MemtoReg ? FAST_SLOW : fast_alu_op(d->ALU_ctrl, c.ALUSrc);
+    }
+    else
+    {
+        // Nothing but the PC changes
+        f->op = d->ALU_ctrl == ALUCTRL_INVALID ? FAST_SLOW : FAST_NOP;
+    }
+}
+
+// Fuse slli feeding an add (index scaling) and addi ahead of the branch that
+// closes the block (loop counters). The second instruction keeps its slot.
+static void block_fuse(fast_ins_t *f, uint64_t len)
+{
+    uint64_t i;
+
+    for(i = 0; i + 1 < len; i++)
+    {
+        if(f[i].op == FAST_SLLI && f[i + 1].op == FAST_ADD &&
+           (f[i + 1].rs1 == f[i].rd || f[i + 1].rs2 == f[i].rd))
+        {
+            f[i++].op = FAST_SLLI_ADD;
+        }
+        else if(f[i].op == FAST_ADDI && f[i + 1].op == FAST_BEQ)
+        {
+            f[i++].op = FAST_ADDI_BEQ;
+        }
+    }
+}
+
+// Translate the basic block starting at instruction pc. It ends after a
+// branch or an instruction left to the datapath, at the end of the program or
+// at BLOCK_MAXLEN instructions.
+static block_t *block_translate(interp_t *t, const d_mem_t *d, uint64_t pc)
+{
+    fast_ins_t f[BLOCK_MAXLEN + 2];
+    fast_ins_t *g = f + 1;
+    const decoded_t *dec;
+    uint64_t len = 0, taken = 0, i;
+    block_t *b;
+
+    while(pc + len < t->cnt && len < BLOCK_MAXLEN)
+    {
+        dec = &d->mem[pc + len];
+        fast_translate(dec, pc + len, t->cnt, &g[len]);
+        len++;
+        if(g[len - 1].op == FAST_BEQ)
+        {
+            taken = (addr_t)((pc + len - 1) * 4 + dec->imm) / 4;
+            break;
+        }
+        if(g[len - 1].op == FAST_SLOW) break;
+    }
+    // Fall through to the next block unless the last instruction decides
+    if(g[len - 1].op != FAST_BEQ) taken = pc + len;
+    if(g[len - 1].op != FAST_BEQ && g[len - 1].op != FAST_SLOW)
+    {
+        memset(&g[len], 0, sizeof(fast_ins_t));
+        g[len].op = FAST_END;
+    }
+    block_fuse(g, len);
+
+    // The entry slot counts runs toward compiling the block
+    memset(&f[0], 0, sizeof(fast_ins_t));
+    f[0].op = FAST_COUNT;
+
+    b = malloc(sizeof(block_t) + (len + 2) * sizeof(fast_ins_t));
+    if(b == NULL)
+    {
+        fputs("ERROR: Failed to allocate translated block\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i <= len + 1; i++) f[i].handler = handlers ? handlers[f[i].op] : NULL;
+    memcpy(b->ins, f, (len + 2) * sizeof(fast_ins_t));
+    b->pc = pc;
+    b->cnt = len;
+    b->succ[0] = pc + len;
+    b->succ[1] = taken;
+    b->next[0] = NULL;
+    b->next[1] = NULL;
+    b->entry = t->jit ? &b->ins[0] : &b->ins[1];
+    b->code = NULL;
+    b->jit_next = NULL;
+    return b;
+}
+
+// Drop all host code once the buffer is full. Blocks only reach host code
+// through their entry slot, so resetting the slots is enough; they count
+// their runs again and are recompiled if they are still hot.
+static void block_flush(interp_t *t)
+{
+    block_t *b;
+
+    for(b = t->compiled; b != NULL; b = b->jit_next)
+    {
+        b->code = NULL;
+        b->ins[0].op = FAST_COUNT;
+        b->ins[0].imm = 0;
+        b->ins[0].handler = handlers ? handlers[FAST_COUNT] : NULL;
+    }
+    t->compiled = NULL;
+    jit_reset(t->jit);
+}
+
+// Compile a block that has become hot. Blocks the JIT cannot handle stay
+// with the interpreter and stop counting.
+static void block_compile(interp_t *t, block_t *b)
+{
+    jit_status_t s;
+
+    s = jit_compile(t->jit, b);
+    if(s == JIT_FULL)
+    {
+        block_flush(t);
+        s = jit_compile(t->jit, b);
+    }
+    if(s != JIT_OK)
+    {
+        b->entry = &b->ins[1];
+        return;
+    }
+    b->ins[0].op = FAST_JIT;
+    b->ins[0].handler = handlers ? handlers[FAST_JIT] : NULL;
+    b->jit_next = t->compiled;
+    t->compiled = b;
+}
+
+// Set up an empty translation cache for the whole program, with a code
+// buffer if jit is set and the host can run it. Waits for the loader to
+// finish.
+interp_t *interp_init(core_t *core, bool jit)
+{
+    interp_t *t;
+
+    d_mem_sync(core->dec_mem, IMEM_MAXSZ);
+    if(INTERP_THREADED && handlers == NULL) interp_exec(NULL, NULL, 0);
+
+    t = malloc(sizeof(interp_t));
+    if(t == NULL) return NULL;
+    t->cnt = core->dec_mem->cnt;
+    t->cache = calloc(t->cnt, sizeof(block_t *));
+    if(t->cache == NULL)
+    {
+        free(t);
+        return NULL;
+    }
+    t->jit = jit ? jit_init() : NULL;
+    t->compiled = NULL;
+    return t;
+}
+
+void interp_delete(interp_t *t)
+{
+    uint64_t i;
+
+    if(t == NULL) return;
+    for(i = 0; i < t->cnt; i++) free(t->cache[i]);
+    free(t->cache);
+    jit_delete(t->jit);
+    free(t);
+}
+
+#if INTERP_THREADED
+#define CASE(op)    L_##op:
+#define JUMP()      goto *ip->handler
+#else
+#define CASE(op)    case FAST_##op:
+#define JUMP()      continue
+#endif
+
+#define NEXT()      ip++; JUMP()
+
+// Leave block b by exit k, going straight on to the successor if it has been
+// chained and fits in the cycle budget
+#define CHAIN() \
+    if(b->next[k] != NULL && b->next[k]->cnt <= left) \
+    { \
+        b = b->next[k]; \
+        left -= b->cnt; \
+        ip = b->entry; \
+        JUMP(); \
+    } \
+    goto chain
+
+// Register and immediate forms of an ALU operation on a and b
+#define ALU_OP(op, expr) \
+    CASE(op)      { register_t a = R[ip->rs1], b = R[ip->rs2]; R[ip->rd] = (expr); } NEXT(); \
+    CASE(op##I)   { register_t a = R[ip->rs1], b = ip->imm;    R[ip->rd] = (expr); } NEXT();
+
+// Run translated blocks from core->PC. Blocks are only entered if they fit in
+// what is left of max_cycles, so instructions are counted per block; the
+// datapath finishes off the last few. Called with t == NULL it only publishes
+// the handler addresses for block_translate().
+static run_status_t interp_exec(core_t *core, interp_t *t, uint64_t max_cycles)
+{
+#if INTERP_THREADED
+#define FAST_LABEL(op) &&L_##op,
+    static const void *const labels[FAST_NOPS] = { FAST_OPS(FAST_LABEL) };
+#undef FAST_LABEL
+#endif
+    const fast_ins_t *ip;
+    block_t *b, **link = NULL;
+    register_t *R;
+    byte_t *M;
+    tick_t clk;
+    uint64_t pc, addr, left = max_cycles;
+    uint32_t k;
+
+    if(t == NULL)
+    {
+#if INTERP_THREADED
+        handlers = labels;
+#endif
+        return RUN_HALTED;
+    }
+
+    R = core->reg_file;
+    M = core->data_mem;
+    clk = core->clk;
+    pc = core->PC / 4;
+
+lookup:
+    if(pc >= t->cnt)
+    {
+        core->PC = pc * 4;
+        core->clk = clk + max_cycles - left;
+        return RUN_HALTED;
+    }
+    b = t->cache[pc];
+    if(b == NULL) b = t->cache[pc] = block_translate(t, core->dec_mem, pc);
+    if(link != NULL) *link = b;
+
+enter:
+    if(b->cnt > left)
+    {
+        core->PC = b->pc * 4;
+        core->clk = clk + max_cycles - left;
+        return core_run(core, left);
+    }
+    left -= b->cnt;
+    ip = b->entry;
+
+#if INTERP_THREADED
+    JUMP();
+#else
+    for(;;) switch(ip->op)
+#endif
+    {
+        CASE(COUNT)
+            if(++b->ins[0].imm < JIT_HOT)
+            {
+                NEXT();
+            }
+            block_compile(t, b);
+            ip = b->entry;
+            JUMP();
+
+        CASE(JIT)
+            k = b->code(R, M);
+            if(k < 2)
+            {
+                CHAIN();
+            }
+            // Instruction k - 2 accessed memory out of range, the registers
+            // are as the instructions before it left them
+            ip = &b->ins[k - 1];
+            mem_fault((uint64_t)R[ip->rs1] + (uint64_t)ip->imm);
+
+        CASE(END)
+            k = 0;
+            CHAIN();
+
+        CASE(BEQ)
+            k = R[ip->rs1] == R[ip->rs2];
+            CHAIN();
+
+        CASE(ADDI_BEQ)
+            R[ip->rd] = (uint64_t)R[ip->rs1] + (uint64_t)ip->imm;
+            ip++;
+            k = R[ip->rs1] == R[ip->rs2];
+            CHAIN();
+
+        CASE(SLOW)
+            core->PC = (b->pc + b->cnt - 1) * 4;
+            core->clk = clk + max_cycles - left - 1;
+            core_run(core, 1);
+            // A branch off the instruction grid leaves the rest to the datapath
+            if(core->PC % 4) return core_run(core, left);
+            pc = core->PC / 4;
+            link = NULL;
+            goto lookup;
+
+        CASE(NOP)
+            NEXT();
+
+        CASE(LOAD)
+            addr = (uint64_t)R[ip->rs1] + (uint64_t)ip->imm;
+            if(addr > MEM_SIZE - 1) mem_fault(addr);
+            R[ip->rd] = M[addr];
+            NEXT();
+
+        CASE(STORE)
+            addr = (uint64_t)R[ip->rs1] + (uint64_t)ip->imm;
+            if(addr > MEM_SIZE - 4) mem_fault(addr);
+            memcpy(&M[addr], &R[ip->rs2], 4);
+            NEXT();
+
+        CASE(SLLI_ADD)
+            R[ip->rd] = (uint64_t)R[ip->rs1] << (ip->imm & 0x3F);
+            ip++;
+            R[ip->rd] = (uint64_t)R[ip->rs1] + (uint64_t)R[ip->rs2];
+            NEXT();
+
+        ALU_OP(ADD, (uint64_t)a + (uint64_t)b)
+        ALU_OP(SUB, (uint64_t)a - (uint64_t)b)
+        ALU_OP(AND, a & b)
+        ALU_OP(OR,  a | b)
+        ALU_OP(XOR, a ^ b)
+        ALU_OP(LT,  a < b)
+        ALU_OP(LTU, (uint64_t)a < (uint64_t)b)
+        ALU_OP(SLL, (uint64_t)a << (b & 0x3F))
+        ALU_OP(SRL, (uint64_t)a >> (b & 0x3F))
+        ALU_OP(SRA, a >> (b & 0x3F))
+
+#if !INTERP_THREADED
+        default:
+            fputs("ERROR: Unrecognized threaded code op\n", stderr);
+            exit(EXIT_FAILURE);
+#endif
+    }
+
+chain:
+    // A successor seen before that does not fit, or one to look up and link
+    if(b->next[k] != NULL)
+    {
+        b = b->next[k];
+        goto enter;
+    }
+    pc = b->succ[k];
+    link = &b->next[k];
+    goto lookup;
+}
+
+// Functional counterpart of core_run(): same architectural results, without
+// modelling the datapath signals. Blocks are translated on first use.
+run_status_t interp_run(core_t *core, uint64_t max_cycles)
+{
+    if(core->interp == NULL)
+    {
+        core->interp = interp_init(core, false);
+        if(core->interp == NULL)
+        {
+            fputs("ERROR: Failed to translate instruction memory\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A misaligned PC can only come from the datapath, let it carry on
+    if(max_cycles == 0 || core->PC % 4) return core_run(core, max_cycles);
+    if(core->PC / 4 >= core->interp->cnt) return RUN_HALTED;
+    return interp_exec(core, core->interp, max_cycles);
+}
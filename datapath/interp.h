@@ -0,0 +1,76 @@
+#ifndef __INTERP_H__
+#define __INTERP_H__
+
+#include "core.h"
+
+// Force the switch dispatch loop even where computed goto is available
+#ifndef INTERP_SWITCH
+#define INTERP_SWITCH 0
+#endif
+
+// Handlers of the functional interpreter. END, BEQ, ADDI_BEQ and SLOW close a
+// block; SLOW hands one instruction to the datapath model for the cases the
+// handlers do not cover. SLLI_ADD and ADDI_BEQ are superinstructions that run
+// the pair in ins[i] and ins[i + 1]. COUNT and JIT only appear in a block's
+// entry slot, see block_t.
+#define FAST_OPS(X) \
+    X(COUNT) X(JIT) X(END) X(SLOW) X(BEQ) X(ADDI_BEQ) X(NOP) X(LOAD) X(STORE) X(SLLI_ADD) \
+    X(ADD)  X(SUB)  X(AND)  X(OR)  X(XOR)  X(LT)  X(LTU)  X(SLL)  X(SRL)  X(SRA) \
+    X(ADDI) X(SUBI) X(ANDI) X(ORI) X(XORI) X(LTI) X(LTUI) X(SLLI) X(SRLI) X(SRAI)
+
+#define FAST_ENUM(op) FAST_##op,
+
+#define BLOCK_MAXLEN 256    // Longest basic block, in instructions
+
+typedef enum fast_op_e
+{
+    FAST_OPS(FAST_ENUM)
+    FAST_NOPS
+} fast_op_t;
+
+// One instruction of threaded code. handler is the label to jump to when the
+// interpreter is built with computed goto, op is used by the switch loop.
+typedef struct fast_ins_s
+{
+    const void *handler;
+    register_t imm;         // ALU immediate or memory offset
+    byte_t op;
+    byte_t rd;
+    byte_t rs1;
+    byte_t rs2;
+} fast_ins_t;
+
+// Host code for a block, see jit.c. Returns the exit taken, 0 or 1, or 2 + i
+// if instruction i of the block accesses data memory out of range.
+typedef uint32_t (*jit_code_t)(register_t *reg_file, byte_t *data_mem);
+
+// Basic block, translated the first time the PC reaches pc and kept for the
+// rest of the run. It ends at a branch and always runs to the end.
+// ins[0] is the entry slot: with the JIT on it counts runs of the block until
+// it is compiled, then calls the host code. entry skips it otherwise.
+typedef struct block_s
+{
+    uint64_t pc;                // PC / 4 of the first instruction
+    uint64_t cnt;               // Instructions in the block
+    uint64_t succ[2];           // PC / 4 after the block: fall-through, taken
+    struct block_s *next[2];    // succ[] blocks, chained once looked up
+    const fast_ins_t *entry;    // ins or ins + 1
+    jit_code_t code;            // Host code, NULL until compiled
+    struct block_s *jit_next;   // Other compiled blocks
+    fast_ins_t ins[];           // Entry slot, cnt instructions, then END unless the last closes it
+} block_t;
+
+// Translation cache for a whole program
+typedef struct interp_s
+{
+    uint64_t cnt;           // Instructions in the program
+    block_t **cache;        // Block starting at each PC / 4, NULL until reached
+    struct jit_s *jit;      // Host code buffer, NULL without the JIT
+    block_t *compiled;      // Blocks with host code in it
+} interp_t;
+
+interp_t *interp_init(core_t *core, bool jit);
+void interp_delete(interp_t *t);
+run_status_t interp_run(core_t *core, uint64_t max_cycles);
+
+#endif // __INTERP_H__
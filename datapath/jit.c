@@ -0,0 +1,238 @@
+#include "jit.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#if JIT_X86
+#include <sys/mman.h>
+#endif
+
+// Most bytes of host code for one instruction, its side exit included
+#define JIT_INSMAX 64
+
+// Host registers used by the generated code. The guest register file comes in
+// rdi and data memory in rsi, as the first two arguments of a jit_code_t.
+enum { RAX = 0, RCX = 1 };
+
+jit_t *jit_init(void)
+{
+#if JIT_X86
+    jit_t *j;
+
+    j = malloc(sizeof(jit_t));
+    if(j == NULL) return NULL;
+    j->buf = mmap(NULL, JIT_BUFSZ, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(j->buf == MAP_FAILED)
+    {
+        free(j);
+        return NULL;
+    }
+    j->size = JIT_BUFSZ;
+    j->used = 0;
+    return j;
+#else
+    return NULL;
+#endif
+}
+
+void jit_delete(jit_t *j)
+{
+    if(j == NULL) return;
+#if JIT_X86
+    munmap(j->buf, j->size);
+#endif
+    free(j);
+}
+
+// Forget every compiled block; the caller must drop its pointers to them
+void jit_reset(jit_t *j)
+{
+    if(j != NULL) j->used = 0;
+}
+
+#if JIT_X86
+static uint8_t *emit(uint8_t *p, const uint8_t *code, size_t n)
+{
+    memcpy(p, code, n);
+    return p + n;
+}
+
+static uint8_t *emit32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+// mov r, [rdi + 8 * reg]
+static uint8_t *emit_get(uint8_t *p, int r, byte_t reg)
+{
+    const uint8_t code[] = { 0x48, 0x8B, 0x87 | r << 3 };
+    return emit32(emit(p, code, 3), reg * 8);
+}
+
+// mov [rdi + 8 * reg], rax
+static uint8_t *emit_put(uint8_t *p, byte_t reg)
+{
+    const uint8_t code[] = { 0x48, 0x89, 0x87 };
+    return emit32(emit(p, code, 3), reg * 8);
+}
+
+// mov rcx, imm
+static uint8_t *emit_imm(uint8_t *p, register_t imm)
+{
+    const uint8_t imm32[] = { 0x48, 0xC7, 0xC1 };
+    const uint8_t imm64[] = { 0x48, 0xB9 };
+
+    if(imm == (int32_t)imm) return emit32(emit(p, imm32, 3), imm);
+    p = emit(p, imm64, 2);
+    memcpy(p, &imm, 8);
+    return p + 8;
+}
+
+// rax = rax op rcx, for the register forms of the ALU handlers
+static uint8_t *emit_alu(uint8_t *p, byte_t op)
+{
+    static const uint8_t arith[][3] =
+    {
+        [FAST_ADD] = { 0x48, 0x01, 0xC8 },  // add rax, rcx
+        [FAST_SUB] = { 0x48, 0x29, 0xC8 },  // sub rax, rcx
+        [FAST_AND] = { 0x48, 0x21, 0xC8 },  // and rax, rcx
+        [FAST_OR]  = { 0x48, 0x09, 0xC8 },  // or rax, rcx
+        [FAST_XOR] = { 0x48, 0x31, 0xC8 },  // xor rax, rcx
+        [FAST_SLL] = { 0x48, 0xD3, 0xE0 },  // shl rax, cl
+        [FAST_SRL] = { 0x48, 0xD3, 0xE8 },  // shr rax, cl
+        [FAST_SRA] = { 0x48, 0xD3, 0xF8 },  // sar rax, cl
+    };
+    // cmp rax, rcx; setl/setb al; movzx eax, al
+    const uint8_t cmp[] = { 0x48, 0x39, 0xC8, 0x0F, op == FAST_LT ? 0x9C : 0x92, 0xC0, 0x0F, 0xB6, 0xC0 };
+
+    // x86 masks 64-bit shift counts to 6 bits, like the datapath ALU
+    if(op == FAST_LT || op == FAST_LTU) return emit(p, cmp, sizeof(cmp));
+    return emit(p, arith[op], 3);
+}
+#endif
+
+// Compile block b into the buffer. Guest registers stay in the register
+// file, so a side exit leaves it exactly as the instructions before it did.
+// Loads and stores outside data memory side-exit before touching it, and
+// interp_exec() reports the fault as MEM() would.
+jit_status_t jit_compile(jit_t *j, block_t *b)
+{
+#if JIT_X86
+    static const uint8_t ret0[] = { 0x31, 0xC0, 0xC3 };                 // xor eax, eax; ret
+    static const uint8_t sete[] = { 0x0F, 0x94, 0xC0, 0x0F, 0xB6, 0xC0, 0xC3 }; // sete al; movzx eax, al; ret
+    static const uint8_t cmp[] = { 0x48, 0x3B, 0x87 };                  // cmp rax, [rdi + disp32]
+    static const uint8_t addr[] = { 0x48, 0x01, 0xC8 };                 // add rax, rcx
+    static const uint8_t bound[] = { 0x48, 0x3D };                      // cmp rax, imm32
+    static const uint8_t ja[] = { 0x0F, 0x87 };                         // ja rel32
+    static const uint8_t ldb[] = { 0x0F, 0xB6, 0x04, 0x06 };            // movzx eax, byte [rsi + rax]
+    static const uint8_t stw[] = { 0x89, 0x0C, 0x06 };                  // mov [rsi + rax], ecx
+    static const uint8_t getw[] = { 0x8B, 0x8F };                       // mov ecx, [rdi + disp32]
+    struct { uint8_t *at; uint32_t i; } fix[BLOCK_MAXLEN];
+    const fast_ins_t *f;
+    uint8_t *start, *p;
+    uint64_t i, nfix = 0;
+    bool closed = false;
+    byte_t op;
+
+    if(j == NULL) return JIT_UNSUPPORTED;
+    for(i = 1; i <= b->cnt; i++)
+    {
+        if(b->ins[i].op == FAST_SLOW) return JIT_UNSUPPORTED;
+    }
+    if(j->size - j->used < (b->cnt + 1) * JIT_INSMAX) return JIT_FULL;
+    if(mprotect(j->buf, j->size, PROT_READ | PROT_WRITE)) return JIT_UNSUPPORTED;
+
+    start = p = j->buf + j->used;
+    for(i = 1; !closed; i++)
+    {
+        f = &b->ins[i];
+        // Superinstructions are compiled as the pair they stand for
+        op = f->op == FAST_SLLI_ADD ? FAST_SLLI : f->op == FAST_ADDI_BEQ ? FAST_ADDI : f->op;
+        switch(op)
+        {
+            case FAST_END:
+                p = emit(p, ret0, sizeof(ret0));
+                closed = true;
+                break;
+            case FAST_BEQ:
+                p = emit_get(p, RAX, f->rs1);
+                p = emit32(emit(p, cmp, sizeof(cmp)), f->rs2 * 8);
+                p = emit(p, sete, sizeof(sete));
+                closed = true;
+                break;
+            case FAST_NOP:
+                break;
+            case FAST_LOAD:
+            case FAST_STORE:
+                p = emit_get(p, RAX, f->rs1);
+                p = emit_imm(p, f->imm);
+                p = emit(p, addr, sizeof(addr));
+                p = emit32(emit(p, bound, sizeof(bound)), op == FAST_LOAD ? MEM_SIZE - 1 : MEM_SIZE - 4);
+                p = emit(p, ja, sizeof(ja));
+                fix[nfix].at = p;
+                fix[nfix++].i = i - 1;
+                p += 4;
+                if(op == FAST_LOAD)
+                {
+                    p = emit(p, ldb, sizeof(ldb));
+                    p = emit_put(p, f->rd);
+                }
+                else
+                {
+                    p = emit32(emit(p, getw, sizeof(getw)), f->rs2 * 8);
+                    p = emit(p, stw, sizeof(stw));
+                }
+                break;
+            default:
+                p = emit_get(p, RAX, f->rs1);
+                if(op >= FAST_ADDI)
+                {
+                    p = emit_imm(p, f->imm);
+                    op -= FAST_ADDI - FAST_ADD;
+                }
+                else
+                {
+                    p = emit_get(p, RCX, f->rs2);
+                }
+                p = emit_alu(p, op);
+                p = emit_put(p, f->rd);
+                break;
+        }
+    }
+
+    // Side exits: mov eax, 2 + i; ret
+    for(i = 0; i < nfix; i++)
+    {
+        emit32(fix[i].at, p - (fix[i].at + 4));
+        *p++ = 0xB8;
+        p = emit32(p, 2 + fix[i].i);
+        *p++ = 0xC3;
+    }
+
+    if(mprotect(j->buf, j->size, PROT_READ | PROT_EXEC)) return JIT_UNSUPPORTED;
+    j->used = (p - j->buf + 15) & ~15ULL;
+    b->code = (jit_code_t)start;
+    return JIT_OK;
+#else
+    (void)j;
+    (void)b;
+    return JIT_UNSUPPORTED;
+#endif
+}
+
+// interp_run() with hot blocks compiled to host code. Falls back to the
+// interpreter alone if the host cannot run it.
+run_status_t jit_run(core_t *core, uint64_t max_cycles)
+{
+    if(core->interp == NULL)
+    {
+        core->interp = interp_init(core, true);
+        if(core->interp == NULL)
+        {
+            fputs("ERROR: Failed to translate instruction memory\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return interp_run(core, max_cycles);
+}
@@ -0,0 +1,41 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "interp.h"
+
+// Host code is only generated for x86-64 Linux; elsewhere jit_init() fails
+// and every block stays with the interpreter
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_X86 1
+#else
+#define JIT_X86 0
+#endif
+
+#define JIT_BUFSZ (16ULL << 20) // Host code buffer, in bytes
+#define JIT_HOT 32              // Runs of a block before it is compiled
+
+typedef struct jit_s jit_t;
+typedef enum jit_status_e jit_status_t;
+
+enum jit_status_e
+{
+    JIT_OK,             // b->code is set
+    JIT_UNSUPPORTED,    // The block has an instruction left to the datapath
+    JIT_FULL            // No room left, see jit_reset()
+};
+
+// Executable buffer that compiled blocks are appended to
+struct jit_s
+{
+    uint8_t *buf;
+    uint64_t size;
+    uint64_t used;
+};
+
+jit_t *jit_init(void);
+void jit_delete(jit_t *j);
+void jit_reset(jit_t *j);
+jit_status_t jit_compile(jit_t *j, block_t *b);
+run_status_t jit_run(core_t *core, uint64_t max_cycles);
+
+#endif // __JIT_H__
@@ -0,0 +1,35 @@
+#ifndef __LEXER_H__
+#define __LEXER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LEX_X86 1
+#else
+#define LEX_X86 0
+#endif
+
+// A token is a view into the mapped trace file; it is not NUL-terminated
+typedef struct
+{
+    const char *s;
+    uint32_t len;
+    uint32_t paren; // offset of the first '(' plus one, 0 if there is none
+} tok_t;
+
+typedef int (*lex_func_t)(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next);
+
+int tokenize(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next);
+void lex_init(void);
+lex_func_t lex_select(void);
+const char *lex_name(lex_func_t f);
+
+int tokenize_scalar(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next);
+#if LEX_X86
+int tokenize_sse2(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next);
+int tokenize_avx2(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next);
+bool lex_has_avx2(void);
+#endif
+
+#endif // __LEXER_H__
@@ -4,7 +4,11 @@
  *  $make clean && make
  *
  * Execute as follows: 
- *  $./RISCV_core <trace file>
+ *  $./RISCV_core [-s] [-f | -j] <trace file | image file>
+ *
+ * -s starts simulating while the trace is still being assembled
+ * -f runs the program on the threaded-code interpreter instead of the datapath
+ * -j does the same, compiling hot blocks to x86-64 code
  *
  * Modified by: Naga Kandasamy
  * Date: August 23, 2024
@@ -16,23 +20,61 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "core.h"
+#include "interp.h"
+#include "jit.h"
 #include "parser.h"
+#include "image.h"
 
 int main(int argc, char **argv)
 {	
 
     uint64_t PC = 0;
     i_mem_t *m;
-    instruction_t *ins;
+    pthread_t loader;
+    bool stream = false;
+    bool fast = false;
+    bool jit = false;
+    int opt;
 
-    if (argc != 2) 
+    while ((opt = getopt(argc, argv, "sfj")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                stream = true;
+                break;
+            case 'f':
+                fast = true;
+                break;
+            case 'j':
+                jit = true;
+                break;
+            default:
+                printf("Usage: %s [-s] [-f | -j] <trace-file>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) 
     {
-        printf("Usage: %s <trace-file>\n", argv[0]);
+        printf("Usage: %s [-s] [-f | -j] <trace-file>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+
+#if VERBOSE == 1
+    // The loader's parse dump would interleave with the per-cycle dump
+    stream = false;
+    // Only the datapath prints the per-cycle dump
+    fast = false;
+    jit = false;
+#endif
     
-    m = load_instructions(argv[1]);
+    // Images from 'assembler -o' are mapped as they are, anything else is a trace
+    m = image_load(argv[optind]);
+    if(m != NULL) stream = false;
+    else if(stream) m = stream_instructions(argv[optind], &loader);
+    else m = load_instructions(argv[optind]);
     if(m == NULL)
     {
         fprintf(stderr, "ERROR: Failed to initialize instruction list\n");
@@ -50,7 +92,9 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    while (core->tick(core));
+    if(jit) jit_run(core, CORE_RUN_FOREVER);
+    else if(fast) interp_run(core, CORE_RUN_FOREVER);
+    else core_run(core, CORE_RUN_FOREVER);
     puts("Simulation complete.\n");
 
     print_core_state(core);
@@ -61,8 +105,9 @@ int main(int argc, char **argv)
     unsigned int end = 32;
     print_data_memory(core, start, end);
 
+    if(stream) pthread_join(loader, NULL);
     i_mem_delete(m);
-    free(core);
+    delete_core(core);
     exit(EXIT_SUCCESS);
 }
 
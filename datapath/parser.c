@@ -3,86 +3,401 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-uint32_t(* parse_funcs[])(opcode_t *opcode, int tokc, char *tokv[]) =
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+uint32_t(* parse_funcs[])(opcode_t *opcode, int tokc, tok_t tokv[]) =
 {
     &parse_NULL_type,
     &parse_R_type, 
     &parse_I_type, 
     &parse_S_type, 
-    &parse_SB_type, 
-    &parse_U_type, 
-    &parse_UJ_type, 
 };
 
-i_mem_t *load_instructions(const char *trace)
+// Formats whose last operand may be a label instead of a number
+uint32_t(* parse_label_funcs[])(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label) =
 {
-    printf("Loading trace file: %s\n\n", trace);
-    FILE *fd = fopen(trace, "r");
-    if (fd == NULL) 
-    {
-        perror("Cannot open trace file. \n");
-        exit(EXIT_FAILURE); 
-    }
+    [SB_TYPE] = &parse_SB_type,
+    [U_TYPE] =  &parse_U_type,
+    [UJ_TYPE] = &parse_UJ_type,
+};
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-    char *tokv[MAXTOKS];
-    int tokc;
-    uint32_t bin;
+// One slice of the trace and the instructions assembled from it
+typedef struct
+{
+    const char *s;
+    const char *end;
     i_mem_t *m;
-    opcode_t opc;
+    symtab_t *syms;     // Labels defined in the slice, addresses relative to it
+    relocs_t *relocs;   // Label references in the slice
+    uint64_t fixed;     // Relocations applied so far when streaming
+    uint64_t publish;   // Publish progress every this many instructions, 0 never
+} load_chunk_t;
+
+// A trace being assembled on its own thread by stream_instructions()
+typedef struct
+{
+    load_chunk_t c;
+    size_t size;
+    int fd;
+} load_stream_t;
+
+// Patch relocations from index i on against syms. Unless final, stop at the
+// first label that has not been defined yet. Returns how many are patched.
+static uint64_t load_resolve(i_mem_t *m, symtab_t *syms, relocs_t *relocs, uint64_t i, bool final)
+{
+    const sym_t *sym;
+    reloc_t *r;
 
-    m = i_mem_init();
-    if(m == NULL)
+    for(; i < relocs->cnt; i++)
     {
-        fputs("ERROR: Failed to initialize instruction memory\n", stderr);
-        exit(EXIT_FAILURE);
+        r = &relocs->r[i];
+        sym = symtab_find(syms, r->name, r->len);
+        if(sym == NULL)
+        {
+            if(!final) break;
+            fprintf(stderr, "ERROR: Undefined label: %.*s\n", r->len, r->name);
+            exit(EXIT_FAILURE);
+        }
+        if(reloc_apply(&m->bin[r->index], r->index * 4, sym->addr))
+        {
+            fprintf(stderr, "ERROR: Label out of range: %.*s\n", r->len, r->name);
+            exit(EXIT_FAILURE);
+        }
     }
+    return i;
+}
 
-    uint64_t pc = 0;
+// Let the core see every instruction before the first unresolved label
+// reference, so it never fetches a branch whose target is still missing
+static void load_publish(load_chunk_t *c, bool done)
+{
+    uint64_t ready = c->m->cnt;
 
-    while ((read = getline(&line, &len, fd)) != EOF) {
-        tokc = tokenize(line, tokv, MAXTOKS, ", \n");
+    c->fixed = load_resolve(c->m, c->syms, c->relocs, c->fixed, done);
+    if(c->fixed < c->relocs->cnt) ready = c->relocs->r[c->fixed].index;
+    i_mem_publish(c->m, ready, done);
+}
+
+// Assemble every line in [c->s, c->end) into c->m, collecting its labels and
+// the references to them
+static void *load_chunk(void *arg)
+{
+    load_chunk_t *c = arg;
+    const char *p, *next;
+    tok_t tokv[MAXTOKS];
+    tok_t *t;
+    tok_t label;
+    int tokc;
+    uint32_t bin;
+    uint8_t opi;
+
+    for (p = c->s; p < c->end; p = next) {
+        tokc = tokenize(p, c->end, tokv, MAXTOKS, &next);
         if(tokc == 0) 
         {
             fputs("Failed to tokenize line\n", stderr);
             exit(EXIT_FAILURE);
         }
 
-        bin = handle_instruction(tokc, tokv, &opc);
-        i_mem_add(m, pc, bin, &opc);
+        // A leading "name:" labels the next instruction
+        t = tokv;
+        if(t[0].s[t[0].len - 1] == ':')
+        {
+            if(!is_label_name(t[0].s, t[0].len - 1))
+            {
+                fprintf(stderr, "ERROR: Invalid label: %.*s\n", t[0].len, t[0].s);
+                exit(EXIT_FAILURE);
+            }
+            if(symtab_add(c->syms, t[0].s, t[0].len - 1, c->m->cnt * 4))
+            {
+                fprintf(stderr, "ERROR: Duplicate label: %.*s\n", t[0].len - 1, t[0].s);
+                exit(EXIT_FAILURE);
+            }
+            if(--tokc == 0) continue;
+            t++;
+        }
+
+        bin = handle_instruction(tokc, t, &opi, &label);
+        if(label.len && relocs_add(c->relocs, c->m->cnt, label.s, label.len))
+        {
+            fputs("ERROR: Failed to record label reference\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        if(i_mem_add(c->m, bin, opi))
+        {
+            fprintf(stderr, "ERROR: Instruction memory full after %llu instructions\n", (unsigned long long)c->m->cnt);
+            exit(EXIT_FAILURE);
+        }
+        if(c->publish && c->m->cnt % c->publish == 0) load_publish(c, false);
+    }
+    return NULL;
+}
 
-        pc += 4;
+// Labels and relocations for one slice or a whole trace
+static void load_chunk_init(load_chunk_t *c, const char *s, const char *end, i_mem_t *m, uint64_t publish)
+{
+    c->s = s;
+    c->end = end;
+    c->m = m;
+    c->syms = symtab_init();
+    c->relocs = relocs_init();
+    c->fixed = 0;
+    c->publish = publish;
+    if(c->m == NULL || c->syms == NULL || c->relocs == NULL)
+    {
+        fputs("ERROR: Failed to initialize instruction memory\n", stderr);
+        exit(EXIT_FAILURE);
     }
+}
 
-    fclose(fd);
-    return m;
+static void load_chunk_delete(load_chunk_t *c)
+{
+    symtab_delete(c->syms);
+    relocs_delete(c->relocs);
 }
 
-uint32_t handle_instruction(int tokc, char *tokv[], opcode_t *opc)
+// Number of workers for a trace of size bytes, 1 to load it sequentially
+static int load_threads(size_t size)
 {
-    int opi;
-    for(opi = 0; opi < NOPS; opi++)
+#if VERBOSE == 1
+    // The parse dump has to come out in trace order
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > LOAD_MAX_THREADS) n = LOAD_MAX_THREADS;
+    if((size_t)n > size / LOAD_CHUNK_MIN) n = size / LOAD_CHUNK_MIN;
+    return n < 1 ? 1 : n;
+#endif
+}
+
+// Split the trace at line boundaries, assemble the slices on nthreads workers
+// and append their instructions to g->m in trace order. Labels and label
+// references are rebased onto the whole trace in g.
+static void load_parallel(const char *buf, const char *end, load_chunk_t *g, int nthreads)
+{
+    pthread_t tid[LOAD_MAX_THREADS];
+    load_chunk_t c[LOAD_MAX_THREADS];
+    const char *p = buf, *q;
+    const sym_t *sym;
+    const reloc_t *r;
+    uint64_t base, j;
+    int i;
+
+    lex_init();
+    for(i = 0; i < nthreads; i++)
+    {
+        q = i == nthreads - 1 ? end : buf + (end - buf) / nthreads * (i + 1);
+        if(q < p) q = p;
+        if(q < end)
+        {
+            q = memchr(q, '\n', end - q);
+            q = q == NULL ? end : q + 1;
+        }
+
+        load_chunk_init(&c[i], p, q, i_mem_init(), 0);
+        if(pthread_create(&tid[i], NULL, &load_chunk, &c[i]))
+        {
+            fputs("ERROR: Failed to start loader thread\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        p = q;
+    }
+
+    for(i = 0; i < nthreads; i++)
     {
-        if(!strcmp(tokv[0], opcode_map[opi].name))
+        pthread_join(tid[i], NULL);
+        base = g->m->cnt;
+        for(j = 0; j < c[i].syms->cap; j++)
         {
-            *opc = opcode_map[opi];
-            if(opc->type == NULL_TYPE)
+            sym = &c[i].syms->tab[j];
+            if(sym->name == NULL) continue;
+            if(symtab_add(g->syms, sym->name, sym->len, sym->addr + base * 4))
             {
-                fprintf(stderr, "Library is broken. My bad\n");
+                fprintf(stderr, "ERROR: Duplicate label: %.*s\n", sym->len, sym->name);
                 exit(EXIT_FAILURE);
             }
-            return parse_funcs[opc->type](opc, tokc, tokv); 
         }
+        for(j = 0; j < c[i].relocs->cnt; j++)
+        {
+            r = &c[i].relocs->r[j];
+            if(relocs_add(g->relocs, r->index + base, r->name, r->len))
+            {
+                fputs("ERROR: Failed to record label reference\n", stderr);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(i_mem_append(g->m, c[i].m))
+        {
+            fprintf(stderr, "ERROR: Instruction memory full after %llu instructions\n", (unsigned long long)g->m->cnt);
+            exit(EXIT_FAILURE);
+        }
+        i_mem_delete(c[i].m);
+        load_chunk_delete(&c[i]);
     }
-    fprintf(stderr, "Failed to parse instruction: %s\n", tokv[0]);
-    exit(EXIT_FAILURE);
+}
+
+// Map the whole trace read-only so it can be tokenized in place. An empty
+// file gives a NULL mapping of size 0.
+static const char *map_trace(const char *trace, size_t *size, int *fdp)
+{
+    printf("Loading trace file: %s\n\n", trace);
+    int fd = open(trace, O_RDONLY);
+    if (fd < 0) 
+    {
+        perror("Cannot open trace file. \n");
+        exit(EXIT_FAILURE); 
+    }
+
+    struct stat st;
+    const char *buf = NULL;
+
+    if(fstat(fd, &st) < 0)
+    {
+        perror("Cannot stat trace file. \n");
+        exit(EXIT_FAILURE);
+    }
+    if(st.st_size > 0)
+    {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(buf == MAP_FAILED)
+        {
+            perror("Cannot map trace file. \n");
+            exit(EXIT_FAILURE);
+        }
+        madvise((void *)buf, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    *size = st.st_size;
+    *fdp = fd;
+    return buf;
+}
+
+static void unmap_trace(const char *buf, size_t size, int fd)
+{
+    if(buf != NULL) munmap((void *)buf, size);
+    close(fd);
+}
+
+i_mem_t *load_instructions(const char *trace)
+{
+    const char *buf;
+    size_t size;
+    int fd;
+    int nthreads;
+    load_chunk_t c;
+
+    buf = map_trace(trace, &size, &fd);
+
+    load_chunk_init(&c, buf, buf + size, i_mem_init(), 0);
+
+    nthreads = load_threads(size);
+    if(nthreads > 1) load_parallel(buf, buf + size, &c, nthreads);
+    else load_chunk(&c);
+    load_publish(&c, true);
+    load_chunk_delete(&c);
+
+    unmap_trace(buf, size, fd);
+    return c.m;
+}
+
+static void *load_stream(void *arg)
+{
+    load_stream_t *ls = arg;
+
+    load_chunk(&ls->c);
+    load_publish(&ls->c, true);
+    load_chunk_delete(&ls->c);
+
+    unmap_trace(ls->c.s, ls->size, ls->fd);
+    free(ls);
+    return NULL;
+}
+
+// Start assembling trace on a new thread and return its instruction memory
+// right away. The core fetches through i_mem_wait(), which blocks only when
+// it gets ahead of the loader. Join *tid before deleting the memory.
+i_mem_t *stream_instructions(const char *trace, pthread_t *tid)
+{
+    load_stream_t *ls;
+    const char *buf, *p, *end;
+    uint64_t lines = 0;
+
+    ls = malloc(sizeof(load_stream_t));
+    if(ls == NULL)
+    {
+        fputs("ERROR: Failed to allocate trace loader\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    buf = map_trace(trace, &ls->size, &ls->fd);
+    load_chunk_init(&ls->c, buf, buf + ls->size, i_mem_init(), LOAD_PUBLISH_EVERY);
+
+    // Every line is at most one instruction, so reserving one slot per line
+    // keeps the arrays from moving while the core reads them
+    for(p = ls->c.s; p < ls->c.end; p = end + 1)
+    {
+        end = memchr(p, '\n', ls->c.end - p);
+        if(end == NULL) end = ls->c.end;
+        lines++;
+    }
+
+    if(i_mem_reserve(ls->c.m, lines))
+    {
+        fputs("ERROR: Failed to initialize instruction memory\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    lex_init();
+    if(pthread_create(tid, NULL, &load_stream, ls))
+    {
+        fputs("ERROR: Failed to start loader thread\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    return ls->c.m;
+}
+
+uint32_t handle_instruction(int tokc, tok_t tokv[], uint8_t *opi, tok_t *label)
+{
+    opcode_t *opc;
+    int i = lookup_opcode(tokv[0].s, tokv[0].len);
+
+    if(i < 0)
+    {
+        fprintf(stderr, "Failed to parse instruction: %.*s\n", tokv[0].len, tokv[0].s);
+        exit(EXIT_FAILURE);
+    }
+    opc = &opcode_map[i];
+    *opi = i;
+    label->len = 0;
+    if(opc->type == NULL_TYPE)
+    {
+        fprintf(stderr, "Library is broken. My bad\n");
+        exit(EXIT_FAILURE);
+    }
+    if(opc->type >= SB_TYPE) return parse_label_funcs[opc->type](opc, tokc, tokv, label);
+    return parse_funcs[opc->type](opc, tokc, tokv);
+}
+
+// Find a mnemonic through the perfect hash, returning its opcode_map index or -1
+int lookup_opcode(const char *name, size_t len)
+{
+    const mnemonic_slot_t *slot;
+    uint64_t key = 0;
+    size_t i;
+
+    if(len == 0 || len > MNEMONIC_MAXLEN) return -1;
+    for(i = 0; i < len; i++) key |= (uint64_t)(uint8_t)name[i] << (8 * i);
+
+    slot = &mnemonic_table[MNEMONIC_HASH(key)];
+    return slot->key == key ? slot->opi : -1;
 }
 
 // Parse and assemble R-type instruction 
-uint32_t parse_R_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_R_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {
     immreg_t immreg;
     int ret = 0;
@@ -132,7 +447,7 @@ uint32_t parse_R_type(opcode_t *opcode, int tokc, char *tokv[])
     return bin;
 }
 
-uint32_t parse_I_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_I_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {
     immreg_t immreg;
     int ret = 0;
@@ -189,11 +504,13 @@ uint32_t parse_I_type(opcode_t *opcode, int tokc, char *tokv[])
     bin |= (func3 << 12);
     bin |= (rs1 << 15);
     bin |= (imm12 << 20);
+    // Shift immediates keep funct7 above the shift amount (srai, sraiw)
+    if((opc == 0x13 || opc == 0x1B) && (func3 == 1 || func3 == 5)) bin |= (opcode->func7 << 25);
 
     return bin;
 }
 
-uint32_t parse_S_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_S_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {    
     immreg_t immreg;
     int ttype;
@@ -239,6 +556,7 @@ uint32_t parse_S_type(opcode_t *opcode, int tokc, char *tokv[])
     bin = 0;
     bin |= opc;
     bin |= (imm_4_0 << 7);
+    bin |= (func3 << 12);
     bin |= (rs1 << 15);
     bin |= (rs2 << 20);
     bin |= (imm_11_5 << 25);
@@ -246,7 +564,7 @@ uint32_t parse_S_type(opcode_t *opcode, int tokc, char *tokv[])
     return bin;
 }
 
-uint32_t parse_SB_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_SB_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label)
 {
     immreg_t immreg;
     int ttype;
@@ -270,8 +588,13 @@ uint32_t parse_SB_type(opcode_t *opcode, int tokc, char *tokv[])
     ttype = get_reg_imm(tokv[2], &immreg);
     rs2 = immreg.reg;
 
-    ttype = get_reg_imm(tokv[3], &immreg);
-    imm12 = immreg.imm;
+    // Label targets are filled in once every label is known
+    if(is_label_name(tokv[3].s, tokv[3].len)) *label = tokv[3];
+    else
+    {
+        ttype = get_reg_imm(tokv[3], &immreg);
+        imm12 = immreg.imm;
+    }
 
 #if VERBOSE == 1
     puts("SB-Type");
@@ -301,77 +624,255 @@ uint32_t parse_SB_type(opcode_t *opcode, int tokc, char *tokv[])
     return bin;
 }
 
-uint32_t parse_U_type(opcode_t *opcode, int tokc, char *tokv[])
+// lui/auipc rd, imm20 or label. lui takes the upper bits of the label's
+// address, auipc the upper bits of its offset from the instruction.
+uint32_t parse_U_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label)
 {
-    fputs("WARNING: U-Type not implemented yet, filling 0\n", stderr);
-    return 0;
+    immreg_t immreg;
+    uint32_t bin;
+    uint32_t opc = opcode->code;
+    uint32_t rd = 0;
+    uint32_t imm20 = 0;
+
+    if(tokc != 3 || tokv == NULL || opcode == NULL)
+    {
+        fputs("ERROR: cmon man\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if(get_reg_imm(tokv[1], &immreg) != 1)
+    {
+        fputs("ERROR: Invalid syntax for U-Type ins\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    rd = immreg.reg;
+
+    if(is_label_name(tokv[2].s, tokv[2].len)) *label = tokv[2];
+    else
+    {
+        get_reg_imm(tokv[2], &immreg);
+        imm20 = immreg.imm;
+    }
+
+#if VERBOSE == 1
+    puts("U-Type");
+    printf("opcode: 0x%x\n", opc);
+    printf("rd: %u\n", rd);
+    printf("imm20: 0x%x\n", imm20);
+    puts("");
+#endif
+
+    bin = 0;
+    bin |= opc;
+    bin |= (rd << 7);
+    bin |= (imm20 & 0xFFFFF) << 12;
+
+    return bin;
 }
 
-uint32_t parse_UJ_type(opcode_t *opcode, int tokc, char *tokv[])
+// jal rd, offset or label; plain "jal target" links through x1
+uint32_t parse_UJ_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label)
 {
-    fputs("WARNING: UJ-Type not implemented yet, filling 0\n", stderr);
-    return 0;
+    immreg_t immreg;
+    tok_t target;
+    uint32_t bin;
+    uint32_t opc = opcode->code;
+    uint32_t rd = 1;
+    uint32_t imm = 0;
+
+    if(tokc < 2 || tokc > 3 || tokv == NULL || opcode == NULL)
+    {
+        fputs("ERROR: cmon man\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if(tokc == 3)
+    {
+        if(get_reg_imm(tokv[1], &immreg) != 1)
+        {
+            fputs("ERROR: Invalid syntax for UJ-Type ins\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+        rd = immreg.reg;
+    }
+
+    target = tokv[tokc - 1];
+    if(is_label_name(target.s, target.len)) *label = target;
+    else
+    {
+        get_reg_imm(target, &immreg);
+        imm = immreg.imm;
+    }
+
+#if VERBOSE == 1
+    puts("UJ-Type");
+    printf("opcode: 0x%x\n", opc);
+    printf("rd: %u\n", rd);
+    printf("imm: 0x%x\n", imm);
+    puts("");
+#endif
+
+    bin = 0;
+    bin |= opc;
+    bin |= (rd << 7);
+    // Same bit scatter as a resolved label, offset from PC 0
+    if(reloc_apply(&bin, 0, (int32_t)imm))
+    {
+        fputs("ERROR: Jump offset out of range\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    return bin;
 }
 
-uint32_t parse_NULL_type(opcode_t *opcode, int tokc, char *tokv[])
+uint32_t parse_NULL_type(opcode_t *opcode, int tokc, tok_t tokv[])
 {
     fputs("ERROR: Tried to parse NULL type. Something is very wrong\n", stderr);
     exit(EXIT_FAILURE);
 }
 
-int get_reg_imm(char *tok, immreg_t *dest)
+int get_reg_imm(tok_t tok, immreg_t *dest)
 {
-    char *p;
-    char *r;
-    if(tok[0] == 'x' || tok[0] == 'f') // pure reg
+    const char *p;
+    tok_t r;
+    if(isalpha((unsigned char)tok.s[0])) // pure reg
     {
         dest->reg = get_register_number(tok);
         return 1;
     }
-    else if((p = strchr(tok, '(')) != NULL) // combo
+    else if(tok.paren) // combo
     {
-        *p = '\0';
-        r = p + 1;
-        r[strlen(r) - 1] = '\0';
-        dest->imm = atoi(tok);
+        p = tok.s + tok.paren - 1;
+        if(tok.s[tok.len - 1] != ')')
+        {
+            fprintf(stderr, "Missing ) in operand: %.*s\n", tok.len, tok.s);
+            exit(EXIT_FAILURE);
+        }
+        r.s = p + 1;
+        r.len = tok.s + tok.len - 1 - r.s;
+        r.paren = 0;
+        tok.len = p - tok.s;
+        dest->imm = get_immediate(tok);
         dest->reg = get_register_number(r);
-        r[strlen(r)] = ')';
-        *p = '(';
         return 2;
     }
     else // pure imm
     {
-        dest->imm = atoi(tok);
+        dest->imm = get_immediate(tok);
         return 3;
     }
 }
 
-uint32_t get_register_number(char *reg)
+uint32_t get_register_number(tok_t reg)
 {
-    int i;
-    for(i = 0; i < NUM_OF_REGS; i++) 
+    int i = parse_register(reg.s, reg.len);
+
+    if(i == -2)
     {
-        if(strcmp(REGISTER_NAME[i], reg) == 0) break;
+        fprintf(stderr, "Register number out of range: %.*s\n", reg.len, reg.s);
+        exit(EXIT_FAILURE);
     }
-    if(i == NUM_OF_REGS)
+    if(i < 0)
     {
-        fprintf(stderr, "Failed to resolve register: %s\n", reg);
+        fprintf(stderr, "Failed to resolve register: %.*s\n", reg.len, reg.s);
         exit(EXIT_FAILURE);
     }
     return i;
 }
 
-int tokenize(char *s, char *tokv[], int maxtokv, char *delim)
+// Parse a signed decimal immediate
+int32_t get_immediate(tok_t imm)
+{
+    int64_t n = 0;
+    uint32_t i = 0;
+    bool neg = false;
+
+    if(imm.len > 0 && (imm.s[0] == '-' || imm.s[0] == '+'))
+    {
+        neg = imm.s[0] == '-';
+        i++;
+    }
+    if(i == imm.len || imm.len - i > 10)
+    {
+        fprintf(stderr, "Invalid immediate: %.*s\n", imm.len, imm.s);
+        exit(EXIT_FAILURE);
+    }
+    for(; i < imm.len; i++)
+    {
+        if(imm.s[i] < '0' || imm.s[i] > '9')
+        {
+            fprintf(stderr, "Invalid immediate: %.*s\n", imm.len, imm.s);
+            exit(EXIT_FAILURE);
+        }
+        n = n * 10 + (imm.s[i] - '0');
+    }
+    return neg ? -n : n;
+}
+
+// Parse the decimal register number in s[0, len), -2 if it is above max
+static int parse_register_index(const char *s, size_t len, int max)
 {
-    char *p;
-    int i = 0;
+    int n = 0;
+    size_t i;
 
-    tokv[i] = strtok(s, delim); 
-    while(tokv[i++] != NULL)
+    if(len == 0 || len > 2 || (len == 2 && s[0] == '0')) return -1;
+    for(i = 0; i < len; i++)
     {
-        if(i >= maxtokv - 1) tokv[i] = NULL;
-        else tokv[i] = strtok(NULL, delim);
+        if(s[i] < '0' || s[i] > '9') return -1;
+        n = n * 10 + (s[i] - '0');
     }
-    return i - 1;
+    return n <= max ? n : -2;
 }
 
+// Resolve xN, fN or an ABI register name in a single pass over its characters.
+// Returns the REGISTER_NAME index (f registers follow the x registers),
+// -1 if the name is not a register and -2 if its number is out of range.
+int parse_register(const char *reg, size_t len)
+{
+    int n;
+
+    if(len < 2) return -1;
+    switch(reg[0])
+    {
+        case 'x':
+            return parse_register_index(reg + 1, len - 1, 31);
+        case 'a': // a0-a7
+            n = parse_register_index(reg + 1, len - 1, 7);
+            return n < 0 ? n : 10 + n;
+        case 's': // s0-s11, sp
+            if(len == 2 && reg[1] == 'p') return 2;
+            n = parse_register_index(reg + 1, len - 1, 11);
+            return n < 0 ? n : n < 2 ? 8 + n : 16 + n;
+        case 't': // t0-t6, tp
+            if(len == 2 && reg[1] == 'p') return 4;
+            n = parse_register_index(reg + 1, len - 1, 6);
+            return n < 0 ? n : n < 3 ? 5 + n : 25 + n;
+        case 'r':
+            return (len == 2 && reg[1] == 'a') ? 1 : -1;
+        case 'g':
+            return (len == 2 && reg[1] == 'p') ? 3 : -1;
+        case 'z':
+            return (len == 4 && reg[1] == 'e' && reg[2] == 'r' && reg[3] == 'o') ? 0 : -1;
+        case 'f':
+            if(len == 2 && reg[1] == 'p') return 8;
+            if(reg[1] >= '0' && reg[1] <= '9')
+            {
+                n = parse_register_index(reg + 1, len - 1, 31);
+                return n < 0 ? n : 32 + n;
+            }
+            switch(reg[1])
+            {
+                case 'a': // fa0-fa7
+                    n = parse_register_index(reg + 2, len - 2, 7);
+                    return n < 0 ? n : 32 + 10 + n;
+                case 's': // fs0-fs11
+                    n = parse_register_index(reg + 2, len - 2, 11);
+                    return n < 0 ? n : 32 + (n < 2 ? 8 + n : 16 + n);
+                case 't': // ft0-ft11
+                    n = parse_register_index(reg + 2, len - 2, 11);
+                    return n < 0 ? n : 32 + (n < 8 ? n : 20 + n);
+            }
+            return -1;
+    }
+    return -1;
+}
@@ -2,9 +2,18 @@
 #include <string.h>
 #include <stdio.h>
 
+static inline void cycle(core_t *core);
+
+// PC has left the program; waits for the loader if it has not got that far
+static inline bool past_end(core_t *core)
+{
+    return core->PC / 4 >= core->dec_mem->cnt && !d_mem_sync(core->dec_mem, core->PC / 4);
+}
+
 core_t *init_core(i_mem_t *i_mem)
 {
-    if(i_mem == NULL || i_mem->cnt == 0)
+    // Wait for the first instruction if the trace is still loading
+    if(i_mem == NULL || i_mem_wait(i_mem, 0) == 0)
     {
         fprintf(stderr, "ERROR: init_core received invalid i_mem\n");
         return NULL;
@@ -17,49 +26,200 @@ core_t *init_core(i_mem_t *i_mem)
         return NULL;
     }
     
-    core->clk = 0;
+    core->dec_mem = d_mem_init(i_mem);
+    if (core->dec_mem == NULL)
+    {
+        fprintf(stderr, "ERROR: Failed to predecode instruction memory\n");
+        free(core);
+        return NULL;
+    }
+
     core->PC = 0;
     core->ins_mem = i_mem;
     core->tick = tick_func;
 
     memset(core->data_mem, 0, MEM_SIZE);
     memset(core->reg_file, 0, NUM_REGISTERS * sizeof(register_t));
+    core_flush(core);
 
     return core;
 }
 
+// Empty the pipeline and zero the counters, keeping the PC, registers and
+// data memory, so the core can start over from an architectural state
+void core_flush(core_t *core)
+{
+    core->clk = 0;
+    core->stalls = 0;
+    core->executed = 0;
+    memset(core->bank, 0, sizeof(core->bank));
+    memset(&core->PC_reg, 0, sizeof(PC_reg_t));
+    memset(&core->HDU_ctrl, 0, sizeof(HDU_ctrl_t));
+    memset(&core->fwd_ctrl, 0, sizeof(fwd_ctrl_t));
+    core->cur = &core->bank[0];
+    core->next = &core->bank[1];
+}
+
+void delete_core(core_t *core)
+{
+    if(core == NULL) return;
+    d_mem_delete(core->dec_mem);
+    free(core);
+}
+
+// Instructions are decoded once, as soon as the loader has published them,
+// since instruction memory is immutable after loading
+d_mem_t *d_mem_init(i_mem_t *i_mem)
+{
+    d_mem_t *d;
+
+    d = malloc(sizeof(d_mem_t));
+    if(d == NULL) return NULL;
+    d->mem = malloc(i_mem->cap * sizeof(decoded_t));
+    if(d->mem == NULL)
+    {
+        free(d);
+        return NULL;
+    }
+    d->cnt = 0;
+    d->src = i_mem;
+    d->done = false;
+
+    d_mem_sync(d, 0);
+    return d;
+}
+
+// Decode everything published past d->cnt, waiting for the loader if
+// instruction index is not there yet. Returns false once index is past the
+// end of the program.
+bool d_mem_sync(d_mem_t *d, uint64_t index)
+{
+    uint64_t ready, i;
+
+    if(index < d->cnt) return true;
+    if(d->done) return false;
+
+    ready = i_mem_wait(d->src, index);
+    for(i = d->cnt; i < ready; i++)
+    {
+        if(!decode(d->src->bin[i], &d->mem[i]))
+        {
+            fprintf(stderr, "ERROR: Unsupported instruction 0x%08x at PC %llu\n", d->src->bin[i],
+                    (unsigned long long)i * 4);
+            exit(EXIT_FAILURE);
+        }
+    }
+    d->cnt = ready;
+    if(index < ready) return true;
+
+    // i_mem_wait() only comes up short once loading is done
+    d->done = true;
+    return false;
+}
+
+int d_mem_delete(d_mem_t *d)
+{
+    if(d == NULL) return 1;
+    free(d->mem);
+    free(d);
+    return 0;
+}
+
+// Extract the datapath fields and control signals of one instruction word.
+// Returns false for jal, jalr, lui and auipc: they write the PC or an upper
+// immediate, which this datapath has no path for.
+bool decode(uint32_t bin, decoded_t *dec)
+{
+    memset(dec, 0, sizeof(decoded_t));
+
+    dec->bin = bin;
+    dec->opcode = bin & 0x7F;
+    dec->func3 = (bin >> 12) & 0x7;
+    dec->func7 = (dec->opcode == 0x33 || dec->opcode == 0x3B) ? (bin >> 25) & 0x7F : 0;
+    dec->imm = imm_gen(bin);
+    // Shift immediates carry funct7 in the upper immediate bits
+    if((dec->opcode == 0x13 || dec->opcode == 0x1B) && (dec->func3 == 1 || dec->func3 == 5))
+    {
+        dec->func7 = (bin >> 25) & 0x7F;
+        dec->imm &= 0x3F;
+    }
+    control_unit(dec->opcode, &dec->ctrl);
+    dec->ALU_ctrl = ALU_control_unit(dec->ctrl.ALUOp, dec->func7, dec->func3);
+
+    dec->rd_addr = (bin >> 7) & 0x1F;
+    dec->rs1_addr = (bin >> 15) & 0x1F;
+    dec->rs2_addr = (bin >> 20) & 0x1F;
+
+    return dec->opcode != 0x17 && dec->opcode != 0x37 && dec->opcode != 0x67 && dec->opcode != 0x6F;
+}
+
 bool tick_func(core_t *core)
 {
-    // Make copy of inter-stage registers
-    IF_ID_t IF_ID = core->IF_ID;
-    ID_EX_t ID_EX = core->ID_EX;
-    EX_MEM_t EX_MEM = core->EX_MEM;
-    MEM_WB_t MEM_WB = core->MEM_WB;
+    return core_run(core, 1) == RUN_CYCLE_LIMIT;
+}
+
+// Run up to max_cycles cycles, stopping early once the PC has left the
+// program and the pipeline has drained
+run_status_t core_run(core_t *core, uint64_t max_cycles)
+{
+    uint64_t n;
+
+    if(past_end(core) && !running(core)) return RUN_HALTED;
+    for(n = 0; n < max_cycles; n++)
+    {
+        cycle(core);
+        if(past_end(core) && !running(core)) return RUN_HALTED;
+    }
+    return RUN_CYCLE_LIMIT;
+}
+
+// Run until max_ins more instructions have left EX, or the program ends.
+// Returns RUN_CYCLE_LIMIT if it stopped on the instruction count.
+run_status_t core_run_ins(core_t *core, uint64_t max_ins)
+{
+    tick_t end = core->executed + max_ins;
+
+    if(past_end(core) && !running(core)) return RUN_HALTED;
+    while(core->executed < end)
+    {
+        cycle(core);
+        if(past_end(core) && !running(core)) return RUN_HALTED;
+    }
+    return RUN_CYCLE_LIMIT;
+}
+
+// Simulate one clock cycle
+static inline void cycle(core_t *core)
+{
+    // Stages read the current bank and write the next one
+    latches_t *cur = core->cur;
+    latches_t *next = core->next;
     // Determine data hazards & forwarding
-    hazard_detection_unit(&ID_EX, &EX_MEM, &core->HDU_ctrl);
-    forwarding_unit(&ID_EX, &EX_MEM, &MEM_WB, &core->fwd_ctrl);
+    hazard_detection_unit(&cur->ID_EX, &cur->EX_MEM, &core->HDU_ctrl);
+    core->stalls += core->HDU_ctrl.stall;
+    // Bubbles left by a stall and fetches past the end are not instructions
+    core->executed += cur->ID_EX.valid && !core->HDU_ctrl.stall;
+    forwarding_unit(&cur->ID_EX, &cur->EX_MEM, &cur->MEM_WB, &core->fwd_ctrl);
     // Instruction Fetch
-    IF(core->PC, core->ins_mem, &core->HDU_ctrl, &core->IF_ID);
+    IF(core->PC, core->dec_mem, &core->HDU_ctrl, &next->IF_ID);
     // Write Back 
-    WB(&MEM_WB, core->reg_file);
-    // Instruction Decode
-    if(&core->HDU_ctrl.stall) IF_ID = core->IF_ID;
-    ID(&IF_ID, core->reg_file, &core->HDU_ctrl, &core->ID_EX);
+    WB(&cur->MEM_WB, core->reg_file);
+    // Instruction Decode of the word fetched this cycle
+    ID(&next->IF_ID, core->reg_file, &core->HDU_ctrl, &next->ID_EX);
     // Execute
-    EX(&ID_EX, &core->fwd_ctrl, &core->HDU_ctrl, &core->EX_MEM, &core->PC_reg);
+    EX(&cur->ID_EX, &core->fwd_ctrl, &core->HDU_ctrl, &next->EX_MEM, &core->PC_reg);
     // Memory
-    MEM(&EX_MEM, core->data_mem, &core->MEM_WB, &core->fwd_ctrl);
+    MEM(&cur->EX_MEM, core->data_mem, &next->MEM_WB, &core->fwd_ctrl);
     // Increment PC or Branch from EX
     PC(&core->PC_reg, &core->PC, &core->HDU_ctrl);
+    // Latch the inter-stage registers by swapping banks
+    core->cur = next;
+    core->next = cur;
 
     core->clk++;
 #if VERBOSE == 1
     puts("");
 #endif
-    // Are we reaching the final instruction?
-    if (core->PC / 4 >= core->ins_mem->cnt) return running(core);
-    
-    return true;
 }
 
 void hazard_detection_unit(ID_EX_t *ID_EX, EX_MEM_t *EX_MEM, HDU_ctrl_t *HDU_ctrl)
@@ -70,7 +230,7 @@ void hazard_detection_unit(ID_EX_t *ID_EX, EX_MEM_t *EX_MEM, HDU_ctrl_t *HDU_ctr
     HDU_ctrl->ctrl_clear = 0;
 
     if(!ID_EX->valid || !EX_MEM->valid) return;
-    if(!EX_MEM->MemRead || !EX_MEM->RegWrite) return;
+    if(!EX_MEM->ctrl.MemRead || !EX_MEM->ctrl.RegWrite) return;
     if(ID_EX->rs1_addr == EX_MEM->rd_addr || ID_EX->rs2_addr == EX_MEM->rd_addr)
     {
         HDU_ctrl->stall = 1;
@@ -84,33 +244,34 @@ void hazard_detection_unit(ID_EX_t *ID_EX, EX_MEM_t *EX_MEM, HDU_ctrl_t *HDU_ctr
     return;
 }
 
-void IF(addr_t PC, i_mem_t *ins_mem, HDU_ctrl_t *HDU_ctrl, IF_ID_t *IF_ID)
+void IF(addr_t PC, d_mem_t *dec_mem, HDU_ctrl_t *HDU_ctrl, IF_ID_t *IF_ID)
 {
-    uint32_t bin;
+    // Decoded form of the all-zero word fed into the pipeline past the end of the program
+    static const decoded_t bubble = { .ALU_ctrl = ALUCTRL_ADD };
+    const decoded_t *dec;
     bool valid;
     bool IF_ID_Write = HDU_ctrl->IF_ID_Write;
     bool stall = HDU_ctrl->stall;
     
     if(!IF_ID_Write) PC -= 4;
-    if(PC / 4 >= ins_mem->cnt)
+    if(PC / 4 >= dec_mem->cnt && !d_mem_sync(dec_mem, PC / 4))
     {
-        bin = 0;
+        dec = &bubble;
         valid = false; 
     }
     else
     {
-        bin = ins_mem->mem[PC / 4].bin;
+        dec = &dec_mem->mem[PC / 4];
         valid = true;
     }
-
     IF_ID->valid = valid;
     IF_ID->PC =    PC;
-    IF_ID->ins =   bin;   
+    IF_ID->dec =   dec;
 #if VERBOSE == 1
     puts("FETCH:");
     if(valid) puts("\tVALID");
     printf("\tPC: %d\n", PC);
-    printf("\tbin: 0x%08x\n", bin);
+    printf("\tbin: 0x%08x\n", dec->bin);
     printf("\tIF_ID_Write: %d\n", IF_ID_Write);
     printf("\tSTALL: %d\n", stall);
 #endif
@@ -119,24 +280,17 @@ void IF(addr_t PC, i_mem_t *ins_mem, HDU_ctrl_t *HDU_ctrl, IF_ID_t *IF_ID)
 
 void ID(IF_ID_t *IF_ID, register_t reg_file[], HDU_ctrl_t *HDU_ctrl, ID_EX_t *ID_EX)
 {
-    byte_t opcode, func3, func7;
-    control_signals_t ctrl = {0};
-    register_t imm;
-    signal_t rd_addr, rs1_addr, rs2_addr;
     register_t rs1, rs2;
+    const decoded_t *dec = IF_ID->dec;
     addr_t PC =    IF_ID->PC;
-    uint32_t bin = IF_ID->ins;
     bool stall = HDU_ctrl->stall;
-
-    opcode = bin & 0x7F;
-    func3 = (bin >> 12) & 0x7;
-    func7 = (opcode == 0x33 || opcode == 0x3B) ? (bin >> 25) & 0x7F : 0;
-    control_unit(opcode, &ctrl);
-    imm = imm_gen(bin);
-
-    rd_addr = (bin >> 7) & 0x1F;
-    rs1_addr = (bin >> 15) & 0x1F;
-    rs2_addr = (bin >> 20) & 0x1F;
+    byte_t func3 =    dec->func3;
+    byte_t func7 =    dec->func7;
+    signal_t rd_addr =  dec->rd_addr;
+    signal_t rs1_addr = dec->rs1_addr;
+    signal_t rs2_addr = dec->rs2_addr;
+    register_t imm =  dec->imm;
+    control_signals_t ctrl = dec->ctrl;
 
     REG(reg_file, rs1_addr, 0, &rs1, 1, 0);
     REG(reg_file, rs2_addr, 0, &rs2, 1, 0);
@@ -146,6 +300,7 @@ void ID(IF_ID_t *IF_ID, register_t reg_file[], HDU_ctrl_t *HDU_ctrl, ID_EX_t *ID
     ID_EX->func3 =    func3;
     ID_EX->func7 =    func7;
     ID_EX->ctrl =     ctrl;
+    ID_EX->ALU_ctrl = dec->ALU_ctrl;
     ID_EX->imm =      imm;
     ID_EX->rs1_addr = rs1_addr; 
     ID_EX->rs1 =      rs1;
@@ -155,7 +310,7 @@ void ID(IF_ID_t *IF_ID, register_t reg_file[], HDU_ctrl_t *HDU_ctrl, ID_EX_t *ID
 #if VERBOSE == 1
     puts("DECODE:");
     if(IF_ID->valid) puts("\tVALID");
-    printf("\topcode: 0x%x\n", opcode);
+    printf("\topcode: 0x%x\n", dec->opcode);
     printf("\tfunc3: %d\n", func3);
     printf("\tfunc7: %d\n", func7);
     printf("\trd: x%d\n", rd_addr);
@@ -181,24 +336,23 @@ void EX(ID_EX_t *ID_EX, fwd_ctrl_t *fwd_ctrl, HDU_ctrl_t *HDU_ctrl, EX_MEM_t *EX
     bool stall = HDU_ctrl->stall;
     register_t rd_addr = ID_EX->rd_addr;
     addr_t PC =          ID_EX->PC;
-    byte_t func3 =       ID_EX->func3;
-    byte_t func7 =       ID_EX->func7;
     signal_t rs1 =       ID_EX->rs1;
     signal_t rs2 =       ID_EX->rs2;
     signal_t imm =       ID_EX->imm;
-    if(stall) memset(&ID_EX->ctrl, 0, sizeof(control_signals_t));
-    signal_t ALUOp =     ID_EX->ctrl.ALUOp;
-    signal_t ALUSrc =    ID_EX->ctrl.ALUSrc;
-    signal_t Branch =    ID_EX->ctrl.Branch;
+    control_signals_t ctrl = ID_EX->ctrl;
+    if(stall) memset(&ctrl, 0, sizeof(control_signals_t));
+    signal_t ALUSrc =    ctrl.ALUSrc;
+    signal_t Branch =    ctrl.Branch;
 
-    ALU_ctrl = ALU_control_unit(ALUOp, func7, func3);
+    // Bubbles and empty slots have their control signals cleared, which selects ADD
+    ALU_ctrl = (stall || !ID_EX->valid) ? ALUCTRL_ADD : ID_EX->ALU_ctrl;
     switch(fwd_ctrl->fwdA)
     {
         case 0: // Normal operation
             rs1 = rs1;
             break;
         case 1: // EX hazard
-            rs1 = EX_MEM->ALU_ret;
+            rs1 = fwd_ctrl->ALU_ret;
             break;
         case 2: // MEM hazard
             rs1 = fwd_ctrl->reg_data_in;
@@ -210,7 +364,7 @@ void EX(ID_EX_t *ID_EX, fwd_ctrl_t *fwd_ctrl, HDU_ctrl_t *HDU_ctrl, EX_MEM_t *EX
             rs2 = rs2;
             break;
         case 1: // EX hazard
-            rs2 = EX_MEM->ALU_ret;
+            rs2 = fwd_ctrl->ALU_ret;
             break;
         case 2: // MEM hazard
             rs2 = fwd_ctrl->reg_data_in;
@@ -225,10 +379,7 @@ void EX(ID_EX_t *ID_EX, fwd_ctrl_t *fwd_ctrl, HDU_ctrl_t *HDU_ctrl, EX_MEM_t *EX
 
     EX_MEM->valid =      ID_EX->valid;
     EX_MEM->ALU_ret =    ALU_ret;
-    EX_MEM->RegWrite =   ID_EX->ctrl.RegWrite;
-    EX_MEM->MemtoReg =   ID_EX->ctrl.MemtoReg;
-    EX_MEM->MemWrite =   ID_EX->ctrl.MemWrite;
-    EX_MEM->MemRead =    ID_EX->ctrl.MemRead;
+    EX_MEM->ctrl =       ctrl;
     EX_MEM->rd_addr =    rd_addr;
     EX_MEM->rs2 =        rs2;
     PC_reg->PCSrc =      PCSrc;
@@ -245,7 +396,7 @@ void EX(ID_EX_t *ID_EX, fwd_ctrl_t *fwd_ctrl, HDU_ctrl_t *HDU_ctrl, EX_MEM_t *EX
     printf("\tinput1: %d\n", input1);
     printf("\tALU zero: %d\n", ALU_zero);
     printf("\tALU ret: %d\n", ALU_ret);
-    printf("\tRegWrite: %d\n", ID_EX->ctrl.RegWrite);
+    printf("\tRegWrite: %d\n", ctrl.RegWrite);
     printf("\tSTALL: %d\n", stall);
 #endif
     return;
@@ -257,18 +408,16 @@ void MEM(EX_MEM_t *EX_MEM, byte_t data_mem[], MEM_WB_t *MEM_WB, fwd_ctrl_t *fwd_
     signal_t reg_data_in;
     register_t ALU_ret = EX_MEM->ALU_ret;
     register_t rs2 =     EX_MEM->rs2;
-    signal_t RegWrite =  EX_MEM->RegWrite;
-    signal_t MemtoReg =  EX_MEM->MemtoReg;
-    signal_t MemRead =   EX_MEM->MemRead;
-    signal_t MemWrite =  EX_MEM->MemWrite;
+    signal_t MemtoReg =  EX_MEM->ctrl.MemtoReg;
+    signal_t MemRead =   EX_MEM->ctrl.MemRead;
+    signal_t MemWrite =  EX_MEM->ctrl.MemWrite;
     register_t rd_addr = EX_MEM->rd_addr;
 
     MEMORY(data_mem, ALU_ret, rs2, &mem_out, MemRead, MemWrite);
     reg_data_in = MUX(MemtoReg, ALU_ret, mem_out);
 
     MEM_WB->valid =       EX_MEM->valid;
-    MEM_WB->RegWrite =    RegWrite;
-    MEM_WB->MemtoReg =    MemtoReg;
+    MEM_WB->ctrl =        EX_MEM->ctrl;
     MEM_WB->reg_data_in = reg_data_in;
     MEM_WB->ALU_ret =     ALU_ret;
     MEM_WB->rd_addr =     rd_addr;
@@ -279,7 +428,7 @@ void MEM(EX_MEM_t *EX_MEM, byte_t data_mem[], MEM_WB_t *MEM_WB, fwd_ctrl_t *fwd_
     if(MemWrite) printf("\tMEM Write: %d -> @%d\n", rs2, ALU_ret);
     if(MemRead) printf("\tMEM Read: %d <- @%d\n", mem_out, ALU_ret);
     printf("\tData to WB: %d\n", reg_data_in);
-    printf("\tRegWrite: %d\n", RegWrite);
+    printf("\tRegWrite: %d\n", EX_MEM->ctrl.RegWrite);
     printf("\tHolding ALU_ret: %d\n", ALU_ret);
     printf("\tHolding rs2: %d\n", rs2);
     printf("\tHolding rd_addr: %d\n", rd_addr);
@@ -290,8 +439,8 @@ void MEM(EX_MEM_t *EX_MEM, byte_t data_mem[], MEM_WB_t *MEM_WB, fwd_ctrl_t *fwd_
 void WB(MEM_WB_t *MEM_WB, register_t reg_file[])
 {
     signal_t reg_data_in = MEM_WB->reg_data_in;
-    signal_t MemtoReg =    MEM_WB->MemtoReg;
-    signal_t RegWrite =    MEM_WB->RegWrite;
+    signal_t MemtoReg =    MEM_WB->ctrl.MemtoReg;
+    signal_t RegWrite =    MEM_WB->ctrl.RegWrite;
     register_t ALU_ret =   MEM_WB->ALU_ret;
     register_t rd_addr =   MEM_WB->rd_addr;
 
@@ -331,10 +480,10 @@ void PC(PC_reg_t *PC_reg, addr_t *PC, HDU_ctrl_t *HDU_ctrl)
 bool running(core_t *core)
 {
     bool valid = 0;
-    valid |= core->IF_ID.valid;
-    valid |= core->ID_EX.valid;
-    valid |= core->EX_MEM.valid;
-    valid |= core->MEM_WB.valid;
+    valid |= core->cur->IF_ID.valid;
+    valid |= core->cur->ID_EX.valid;
+    valid |= core->cur->EX_MEM.valid;
+    valid |= core->cur->MEM_WB.valid;
     return valid;
 }
 
@@ -342,15 +491,16 @@ void forwarding_unit(ID_EX_t *ID_EX, EX_MEM_t *EX_MEM, MEM_WB_t *MEM_WB, fwd_ctr
 {
     fwd_ctrl->fwdA = 0;
     fwd_ctrl->fwdB = 0;
+    fwd_ctrl->ALU_ret = EX_MEM->ALU_ret;
 
     // Detect MEM forwarding
-    if(MEM_WB->RegWrite && ID_EX->valid && MEM_WB->valid)
+    if(MEM_WB->ctrl.RegWrite && ID_EX->valid && MEM_WB->valid)
     {
         if(ID_EX->rs1_addr == MEM_WB->rd_addr) fwd_ctrl->fwdA = 2;
         if(ID_EX->rs2_addr == MEM_WB->rd_addr) fwd_ctrl->fwdB = 2;
     }
     // Detect EX forwarding
-    if(EX_MEM->RegWrite && ID_EX->valid && EX_MEM->valid && !EX_MEM->MemRead)
+    if(EX_MEM->ctrl.RegWrite && ID_EX->valid && EX_MEM->valid && !EX_MEM->ctrl.MemRead)
     {
         if(ID_EX->rs1_addr == EX_MEM->rd_addr) fwd_ctrl->fwdA = 1;
         if(ID_EX->rs2_addr == EX_MEM->rd_addr) fwd_ctrl->fwdB = 1;
@@ -359,74 +509,56 @@ void forwarding_unit(ID_EX_t *ID_EX, EX_MEM_t *EX_MEM, MEM_WB_t *MEM_WB, fwd_ctr
     return;
 }
 
+// Control signals for each opcode in opcode_map, indexed by the 7-bit opcode.
+// Opcodes without an entry (U/UJ-type and jalr) have no control signals;
+// decode() rejects them. System instructions execute as a nop.
+static const control_signals_t control_table[128] =
+{
+    //        Branch MemRead MemtoReg ALUOp MemWrite ALUSrc RegWrite
+    [0x03] = {0,     1,      1,       0,    0,       1,     1}, // Load
+    [0x13] = {0,     0,      0,       2,    0,       1,     1}, // I-type
+    [0x1B] = {0,     0,      0,       3,    0,       1,     1}, // I-type word
+    [0x23] = {0,     0,      0,       0,    1,       1,     0}, // Store
+    [0x33] = {0,     0,      0,       2,    0,       0,     1}, // R-type
+    [0x3B] = {0,     0,      0,       3,    0,       0,     1}, // R-type word
+    [0x63] = {1,     0,      0,       1,    0,       0,     0}, // SB-type
+    [0x73] = {0,     0,      0,       0,    0,       0,     0}, // System
+};
+
+// ALU control, indexed by ALUOp, bit 5 of funct7 and funct3
+static const byte_t alu_ctrl_table[4][2][8] =
+{
+    { // ALUOp 0: loads and stores compute an address
+        {ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD},
+        {ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD, ALUCTRL_ADD},
+    },
+    { // ALUOp 1: branches compare by subtracting
+        {ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB},
+        {ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB, ALUCTRL_SUB},
+    },
+    { // ALUOp 2: R-type and I-type, decided by funct7 and funct3
+        //  000          001           010          011           100           101           110          111
+        {ALUCTRL_ADD, ALUCTRL_SLL, ALUCTRL_LT,  ALUCTRL_LTU, ALUCTRL_XOR, ALUCTRL_SRL, ALUCTRL_OR,  ALUCTRL_AND},
+        {ALUCTRL_SUB, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_SRA, ALUCTRL_INVALID, ALUCTRL_INVALID},
+    },
+    { // ALUOp 3: word R-type and I-type, 32-bit results sign-extended
+        //  000           001              010              011              100              101           110              111
+        {ALUCTRL_ADDW, ALUCTRL_SLLW,    ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_SRLW, ALUCTRL_INVALID, ALUCTRL_INVALID},
+        {ALUCTRL_SUBW, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_INVALID, ALUCTRL_SRAW, ALUCTRL_INVALID, ALUCTRL_INVALID},
+    },
+};
+
 void control_unit(signal_t input, control_signals_t *signals)
 {
-    // For R-type
-    if(input == 0x33) 
-    {
-        signals->ALUSrc = 0;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 1;
-        signals->MemRead = 0;
-        signals->MemWrite = 0;
-        signals->Branch = 0;
-        signals->ALUOp = 2;
-    }
-    else if(input == 0x23) // Store instruction
-    {
-        signals->ALUSrc = 1;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 0;
-        signals->MemRead = 0;
-        signals->MemWrite = 1;
-        signals->Branch = 0;
-        signals->ALUOp = 0;
-    }
-    else if(input == 0x03) // Load instruction
-    {
-        signals->ALUSrc = 1;
-        signals->MemtoReg = 1;
-        signals->RegWrite = 1;
-        signals->MemRead = 1;
-        signals->MemWrite = 0;
-        signals->Branch = 0;
-        signals->ALUOp = 0;
-    }
-    else if(input == 0x13) // I-Type
-    {
-        signals->ALUSrc = 1;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 1;
-        signals->MemRead = 0;
-        signals->MemWrite = 0;
-        signals->Branch = 0;
-        signals->ALUOp = 2; 
-    }
-    else if(input == 0x63) // SB type
-    {
-        signals->ALUSrc = 0;
-        signals->MemtoReg = 0;
-        signals->RegWrite = 0;
-        signals->MemRead = 0;
-        signals->MemWrite = 0;
-        signals->Branch = 1;
-        signals->ALUOp = 1;
-    }
+    *signals = control_table[input & 0x7F];
 }
 
 signal_t ALU_control_unit(signal_t ALUOp, signal_t Funct7, signal_t Funct3)
 {
-    if(ALUOp == 0) return ALUCTRL_ADD;
-    if(ALUOp == 1) return ALUCTRL_SUB;
-    if(ALUOp == 2)
-    {
-        if(Funct7 == 0 && Funct3 == 0)  return ALUCTRL_ADD;
-        if(Funct7 == 0 && Funct3 == 1)  return ALUCTRL_SLL;
-        if(Funct7 == 0 && Funct3 == 7) return ALUCTRL_AND;
-        if(Funct7 == 0 && Funct3 == 6) return ALUCTRL_OR;
-        if(Funct7 == 0x20 && Funct3 == 0) return ALUCTRL_SUB;
-    }
-    fputs("ALU Control Unit failed to parse signal\n", stderr); 
+    byte_t ALU_ctrl = alu_ctrl_table[ALUOp & 0x3][(Funct7 >> 5) & 0x1][Funct3 & 0x7];
+
+    if(ALU_ctrl == ALUCTRL_INVALID) fputs("ALU Control Unit failed to parse signal\n", stderr); 
+    return ALU_ctrl;
 }
 
 signal_t imm_gen(signal_t input)
@@ -439,7 +571,7 @@ signal_t imm_gen(signal_t input)
     // R-Type
     if(opcode == 0x33 || opcode == 0x3B) return 0;
     // I-Type
-    if(opcode == 0x03 || opcode == 0x13)
+    if(opcode == 0x03 || opcode == 0x13 || opcode == 0x1B || opcode == 0x67 || opcode == 0x73)
     {
         im = input >> 20;
         if(im & (1 << 11)) im |= ~(0xFFF);
@@ -467,6 +599,28 @@ signal_t imm_gen(signal_t input)
         im |= i_12 ? ~(0x1FFF) : 0;
         return im;
     }
+    // U-Type
+    if(opcode == 0x17 || opcode == 0x37)
+    {
+        im = input & 0xFFFFF000;
+        if(im & (1L << 31)) im |= ~(0xFFFFFFFFL);
+        return im;
+    }
+    // UJ-Type
+    if(opcode == 0x6F)
+    {
+        signal_t i_20 = (input >> 31) & 0x1;
+        signal_t i_19_12 = (input >> 12) & 0xFF;
+        signal_t i_11 = (input >> 20) & 0x1;
+        signal_t i_10_1 = (input >> 21) & 0x3FF;
+
+        im |= i_20 << 20;
+        im |= i_19_12 << 12;
+        im |= i_11 << 11;
+        im |= i_10_1 << 1;
+        im |= i_20 ? ~(0x1FFFFF) : 0;
+        return im;
+    }
     puts("BOY WHAT THE HEEEELLLLLLL");
     printf("opcode: 0x%x\n", opcode);
     return 0;
@@ -494,11 +648,38 @@ void ALU(signal_t input_0, signal_t input_1, signal_t ALU_ctrl_signal, signal_t
         case ALUCTRL_SUB:
             *ALU_result = input_0 - input_1;
             break;
+        case ALUCTRL_LT:
+            *ALU_result = input_0 < input_1;
+            break;
+        case ALUCTRL_LTU:
+            *ALU_result = (uint64_t)input_0 < (uint64_t)input_1;
+            break;
+        case ALUCTRL_XOR:
+            *ALU_result = input_0 ^ input_1;
+            break;
         case ALUCTRL_SRL:
-            *ALU_result = input_0 >> input_1;
+            *ALU_result = (uint64_t)input_0 >> (input_1 & 0x3F);
+            break;
+        case ALUCTRL_SRA:
+            *ALU_result = input_0 >> (input_1 & 0x3F);
             break;
         case ALUCTRL_SLL:
-            *ALU_result = input_0 << input_1;
+            *ALU_result = (uint64_t)input_0 << (input_1 & 0x3F);
+            break;
+        case ALUCTRL_ADDW:
+            *ALU_result = (int32_t)((uint64_t)input_0 + (uint64_t)input_1);
+            break;
+        case ALUCTRL_SUBW:
+            *ALU_result = (int32_t)((uint64_t)input_0 - (uint64_t)input_1);
+            break;
+        case ALUCTRL_SLLW:
+            *ALU_result = (int32_t)((uint32_t)input_0 << (input_1 & 0x1F));
+            break;
+        case ALUCTRL_SRLW:
+            *ALU_result = (int32_t)((uint32_t)input_0 >> (input_1 & 0x1F));
+            break;
+        case ALUCTRL_SRAW:
+            *ALU_result = (int32_t)input_0 >> (input_1 & 0x1F);
             break;
         default:
             fputs("ERROR: Unrecognized ALUCTRL\n", stderr);
@@ -508,6 +689,14 @@ void ALU(signal_t input_0, signal_t input_1, signal_t ALU_ctrl_signal, signal_t
     *zero = *ALU_result == 0;
 }
 
+// Stop on a load or store outside data memory. Loads read one byte and
+// stores write four, so the last address either may use differs.
+void mem_fault(signal_t addr)
+{
+    fprintf(stderr, "ERROR: Data memory access out of range at address %lld\n", (long long)addr);
+    exit(EXIT_FAILURE);
+}
+
 // Perform read and write memory operations
 void MEMORY(byte_t data_mem[], signal_t addr, signal_t data_in, signal_t *data_out, signal_t read, signal_t write)
 {
@@ -516,6 +705,7 @@ void MEMORY(byte_t data_mem[], signal_t addr, signal_t data_in, signal_t *data_o
         fputs("ERROR: MEM received a NULL pointer\n", stderr);
         exit(EXIT_FAILURE);
     }
+    if((read && (uint64_t)addr > MEM_SIZE - 1) || (write && (uint64_t)addr > MEM_SIZE - 4)) mem_fault(addr);
 
     if(read && data_out)
     {
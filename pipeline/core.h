@@ -14,77 +14,126 @@ typedef uint8_t byte_t;
 typedef int64_t signal_t;
 typedef int64_t register_t;
 
+#define CORE_RUN_FOREVER UINT64_MAX // No cycle limit for core_run()
+
 typedef struct core_s core_t;
+typedef enum run_status_e run_status_t;
 typedef enum aluctrl_e aluctrl_t;
 
+// Why core_run() returned
+enum run_status_e
+{
+    RUN_HALTED,      // The program has finished
+    RUN_CYCLE_LIMIT  // max_cycles elapsed first
+};
+
 enum aluctrl_e
 {
     ALUCTRL_AND = 0,  // 0000
     ALUCTRL_OR,       // 0001
     ALUCTRL_ADD,      // 0010
-    ALUCTRL_SUB = 6,  // 0110
+    ALUCTRL_LTU,      // 0011
+    ALUCTRL_ADDW,     // 0100
+    ALUCTRL_SUBW,     // 0101
+    ALUCTRL_SUB,      // 0110
     ALUCTRL_LT,       // 0111
     ALUCTRL_SRL,      // 1000
     ALUCTRL_SLL,      // 1001
-    ALUCTRL_SRA = 10, // 1010
-    ALUCTRL_XOR = 13  // 1101
+    ALUCTRL_SRA,      // 1010
+    ALUCTRL_SLLW,     // 1011
+    ALUCTRL_SRLW,     // 1100
+    ALUCTRL_XOR,      // 1101
+    ALUCTRL_SRAW,     // 1110
+    ALUCTRL_INVALID   // 1111
 };
 
-// Definition of the various control signals
+// Definition of the various control signals, packed into a single byte
 typedef struct control_signals_s {
-    signal_t Branch;
-    signal_t MemRead;
-    signal_t MemtoReg;
-    signal_t ALUOp;
-    signal_t MemWrite;
-    signal_t ALUSrc;
-    signal_t RegWrite;
+    uint8_t Branch   : 1;
+    uint8_t MemRead  : 1;
+    uint8_t MemtoReg : 1;
+    uint8_t ALUOp    : 2;
+    uint8_t MemWrite : 1;
+    uint8_t ALUSrc   : 1;
+    uint8_t RegWrite : 1;
 } control_signals_t;
 
+// Instruction predecoded once at load time so ID does not re-decode every cycle
+typedef struct decoded_s
+{
+    register_t imm;
+    uint32_t bin;
+    control_signals_t ctrl;
+    byte_t ALU_ctrl;
+    byte_t opcode;
+    byte_t func3;
+    byte_t func7;
+    byte_t rd_addr;
+    byte_t rs1_addr;
+    byte_t rs2_addr;
+} decoded_t;
+
+// Predecoded instruction memory, indexed by PC / 4 like i_mem_t
+typedef struct d_mem_s
+{
+    uint64_t cnt;       // Instructions decoded so far
+    decoded_t *mem;
+    i_mem_t *src;       // Instruction memory being decoded
+    bool done;          // cnt covers the whole program
+} d_mem_t;
+
+// Inter-stage registers are laid out widest field first so the four of them
+// fit in two cache lines; register addresses are bytes and signals are bits
 typedef struct IF_ID_s
 {
-    bool valid;
+    const decoded_t *dec;
     addr_t PC;
-    uint32_t ins;
+    bool valid;
 } IF_ID_t;
 
 typedef struct ID_EX_s
 {
-    bool valid;
-    control_signals_t ctrl;
     addr_t PC;
-    register_t rs1_addr;
     register_t rs1;
-    register_t rs2_addr;
     register_t rs2;
-    register_t rd_addr;
     register_t imm;
+    byte_t rs1_addr;
+    byte_t rs2_addr;
+    byte_t rd_addr;
+    byte_t ALU_ctrl;
     byte_t func3;
     byte_t func7;
+    control_signals_t ctrl;
+    bool valid;
 } ID_EX_t;
 
 typedef struct EX_MEM_s
 {
-    bool valid;
-    signal_t RegWrite;
-    signal_t MemtoReg;
-    signal_t MemWrite;
-    signal_t MemRead;
     register_t ALU_ret;
     register_t rs2;
-    register_t rd_addr;
+    byte_t rd_addr;
+    control_signals_t ctrl;
+    bool valid;
 } EX_MEM_t;
 
 typedef struct MEM_WB_s
 {
-    bool valid;
-    signal_t RegWrite;
-    signal_t MemtoReg;
     register_t reg_data_in;
     register_t ALU_ret;
-    register_t rd_addr;
+    byte_t rd_addr;
+    control_signals_t ctrl;
+    bool valid;
 } MEM_WB_t;
 
+// One bank of inter-stage registers
+typedef struct latches_s
+{
+    IF_ID_t IF_ID;
+    ID_EX_t ID_EX;
+    EX_MEM_t EX_MEM;
+    MEM_WB_t MEM_WB;
+} latches_t;
+
 typedef struct PC_reg_s
 {
     signal_t PCSrc;
@@ -103,20 +152,23 @@ typedef struct fwd_ctrl_s
 {
     byte_t fwdA;
     byte_t fwdB;
-    register_t reg_data_in;
+    register_t ALU_ret;     // Value forwarded on an EX hazard
+    register_t reg_data_in; // Value forwarded on a MEM hazard
 } fwd_ctrl_t;
 
 // Definition of the RISC-V core
 struct core_s {
     tick_t clk;                         // Core clock
+    tick_t stalls;                      // Cycles lost to load-use hazards
+    tick_t executed;                    // Instructions that have left EX
     addr_t PC;                          // Program counter
     i_mem_t *ins_mem;                   // Instruction memory 
+    d_mem_t *dec_mem;                   // Predecoded instruction memory
     byte_t data_mem[MEM_SIZE];          // Data memory
     register_t reg_file[NUM_REGISTERS]; // Register file.
-    IF_ID_t IF_ID;
-    ID_EX_t ID_EX;
-    EX_MEM_t EX_MEM;
-    MEM_WB_t MEM_WB;
+    latches_t bank[2];                  // Inter-stage register banks
+    latches_t *cur;                     // Registers latched at the start of the cycle
+    latches_t *next;                    // Registers written by the stages this cycle
     PC_reg_t PC_reg;
     HDU_ctrl_t HDU_ctrl;
     fwd_ctrl_t fwd_ctrl;
@@ -124,9 +176,17 @@ struct core_s {
 };
 
 core_t *init_core(i_mem_t *i_mem);
+void delete_core(core_t *core);
+void core_flush(core_t *core);
+d_mem_t *d_mem_init(i_mem_t *i_mem);
+int d_mem_delete(d_mem_t *d);
+bool d_mem_sync(d_mem_t *d, uint64_t index);
+bool decode(uint32_t bin, decoded_t *dec);
 bool tick_func(core_t *core);
+run_status_t core_run(core_t *core, uint64_t max_cycles);
+run_status_t core_run_ins(core_t *core, uint64_t max_ins);
 void hazard_detection_unit(ID_EX_t *ID_EX, EX_MEM_t *EX_MEM, HDU_ctrl_t *HDU_ctrl); 
-void IF(addr_t PC, i_mem_t *ins_mem, HDU_ctrl_t *HDU_ctrl, IF_ID_t *IF_ID);
+void IF(addr_t PC, d_mem_t *dec_mem, HDU_ctrl_t *HDU_ctrl, IF_ID_t *IF_ID);
 void ID(IF_ID_t *IF_ID, register_t reg_file[], HDU_ctrl_t *HDU_ctrl, ID_EX_t *ID_EX);
 void EX(ID_EX_t *ID_EX, fwd_ctrl_t *fwd_ctrl, HDU_ctrl_t *HDU_ctrl, EX_MEM_t *EX_MEM, PC_reg_t *PC_reg);
 void MEM(EX_MEM_t *EX_MEM, byte_t data_mem[], MEM_WB_t *MEM_WB, fwd_ctrl_t *fwd_ctrl);
@@ -139,6 +199,7 @@ signal_t ALU_control_unit(signal_t ALUOp, signal_t funct7, signal_t funct3);
 signal_t imm_gen(signal_t input);
 void ALU(signal_t input_0, signal_t input_1, signal_t ALU_ctrl_signal, signal_t *ALU_result, signal_t *zero);
 void MEMORY(byte_t data_mem[], signal_t addr, signal_t data_in, signal_t *data_out, signal_t read, signal_t write);
+void mem_fault(signal_t addr);
 void REG(register_t reg_file[], signal_t addr, register_t data_in, register_t *data_out, signal_t read, signal_t write);
 signal_t MUX(signal_t sel, signal_t input_0, signal_t input_1);
 signal_t Add(signal_t input_0, signal_t input_1);
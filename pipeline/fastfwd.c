@@ -0,0 +1,113 @@
+#include "fastfwd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Execute at least n instructions from core->PC on the architectural state
+// alone: registers and data memory change as the pipeline would leave them,
+// but no cycles or stalls are counted. Branches keep the pipeline's single
+// delay slot, so this only stops where no branch is pending and the pipeline
+// can carry on from core->PC with empty latches. Returns the number of
+// instructions executed, fewer than n if the program ended first.
+static inline uint64_t forward(core_t *core, uint64_t n, bbv_t *bbv)
+{
+    d_mem_t *d = core->dec_mem;
+    register_t *reg = core->reg_file;
+    byte_t *mem = core->data_mem;
+    const decoded_t *dec;
+    control_signals_t ctrl;
+    addr_t pc, npc, target, last, leader = 0;
+    signal_t a, b, ALU_ret = 0, zero, mem_out = 0;
+    uint64_t cnt = d->cnt, done = 0;
+
+    if(running(core))
+    {
+        fputs("ERROR: Cannot fast-forward a core with instructions in flight\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    pc = core->PC;
+    npc = pc + 4;
+    last = pc - 8;
+    while(done < n || npc != pc + 4)
+    {
+        target = npc + 4;
+        if(pc / 4 < cnt || d_mem_sync(d, pc / 4))
+        {
+            cnt = d->cnt;
+            dec = &d->mem[pc / 4];
+            ctrl = dec->ctrl;
+
+            // The ALU, MEMORY() and the write-back MUX of core.c, inlined
+            a = reg[dec->rs1_addr];
+            b = ctrl.ALUSrc ? dec->imm : reg[dec->rs2_addr];
+            switch(dec->ALU_ctrl)
+            {
+                case ALUCTRL_AND: ALU_ret = a & b; break;
+                case ALUCTRL_OR:  ALU_ret = a | b; break;
+                case ALUCTRL_ADD: ALU_ret = (uint64_t)a + (uint64_t)b; break;
+                case ALUCTRL_SUB: ALU_ret = (uint64_t)a - (uint64_t)b; break;
+                case ALUCTRL_LT:  ALU_ret = a < b; break;
+                case ALUCTRL_LTU: ALU_ret = (uint64_t)a < (uint64_t)b; break;
+                case ALUCTRL_XOR: ALU_ret = a ^ b; break;
+                case ALUCTRL_SRL: ALU_ret = (uint64_t)a >> (b & 0x3F); break;
+                case ALUCTRL_SRA: ALU_ret = a >> (b & 0x3F); break;
+                case ALUCTRL_SLL: ALU_ret = (uint64_t)a << (b & 0x3F); break;
+                case ALUCTRL_ADDW: ALU_ret = (int32_t)((uint64_t)a + (uint64_t)b); break;
+                case ALUCTRL_SUBW: ALU_ret = (int32_t)((uint64_t)a - (uint64_t)b); break;
+                case ALUCTRL_SLLW: ALU_ret = (int32_t)((uint32_t)a << (b & 0x1F)); break;
+                case ALUCTRL_SRLW: ALU_ret = (int32_t)((uint32_t)a >> (b & 0x1F)); break;
+                case ALUCTRL_SRAW: ALU_ret = (int32_t)a >> (b & 0x1F); break;
+                // Reports the bad control the way EX does
+                default: ALU(a, b, dec->ALU_ctrl, &ALU_ret, &zero); break;
+            }
+            zero = ALU_ret == 0;
+            if(ctrl.MemRead)
+            {
+                if((uint64_t)ALU_ret > MEM_SIZE - 1) mem_fault(ALU_ret);
+                mem_out = mem[ALU_ret];
+            }
+            if(ctrl.MemWrite)
+            {
+                if((uint64_t)ALU_ret > MEM_SIZE - 4) mem_fault(ALU_ret);
+                memcpy(&mem[ALU_ret], &reg[dec->rs2_addr], 4);
+            }
+            if(ctrl.RegWrite) reg[dec->rd_addr] = ctrl.MemtoReg ? mem_out : ALU_ret;
+            // The branch resolves in EX, after the next instruction has been fetched
+            if(ctrl.Branch && zero) target = pc + dec->imm;
+            done++;
+            if(bbv != NULL)
+            {
+                // A block starts wherever control did not fall through
+                if(pc != last + 4)
+                {
+                    leader = pc / 4;
+                    if(bbv->count[leader] == 0) bbv->touched[bbv->n++] = leader;
+                }
+                bbv->count[leader]++;
+                last = pc;
+            }
+        }
+        // Past the end the pipeline only fetches bubbles, until a branch in
+        // flight brings it back or there is nothing left to drain
+        else if(npc / 4 >= d->cnt && !d_mem_sync(d, npc / 4))
+        {
+            break;
+        }
+        pc = npc;
+        npc = target;
+    }
+    core->PC = pc;
+    return done;
+}
+
+uint64_t fastfwd_run(core_t *core, uint64_t n)
+{
+    return forward(core, n, NULL);
+}
+
+// fastfwd_run() that also adds the instructions executed to bbv, by block
+uint64_t fastfwd_profile(core_t *core, uint64_t n, bbv_t *bbv)
+{
+    return forward(core, n, bbv);
+}
@@ -0,0 +1,19 @@
+#ifndef __FASTFWD_H__
+#define __FASTFWD_H__
+
+#include "core.h"
+
+// Basic block vector collected by fastfwd_profile(). count has an entry for
+// every instruction index, but only block leaders are ever counted; touched
+// lists the n leaders counted so far, so clearing it does not scan the program.
+typedef struct bbv_s
+{
+    uint64_t *count;    // Instructions executed in the block led by each index
+    uint64_t *touched;
+    uint64_t n;
+} bbv_t;
+
+uint64_t fastfwd_run(core_t *core, uint64_t n);
+uint64_t fastfwd_profile(core_t *core, uint64_t n, bbv_t *bbv);
+
+#endif // __FASTFWD_H__
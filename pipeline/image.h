@@ -0,0 +1,39 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdint.h>
+
+#include "instruction.h"
+
+// Binary program image written by the assembler and mapped by RISCV_core.
+// Every field is little-endian. The header is followed by the sections it
+// points at, each starting on an 8-byte boundary:
+//  text    cnt 32-bit instruction words, indexed by PC / 4
+//  opi     cnt opcode_map indices, one byte each (optional)
+//  sym     image_sym_t entries followed by their names (optional)
+// The opi section depends on the order of opcode_map, so IMAGE_VERSION must
+// change whenever that table does.
+#define IMAGE_MAGIC "RVIM"
+#define IMAGE_VERSION 1
+
+typedef struct image_hdr_s
+{
+    char magic[4];          // IMAGE_MAGIC, no terminator
+    uint32_t version;       // IMAGE_VERSION
+    uint64_t cnt;           // Instructions in the text section
+    uint64_t text_off;      // File offsets of the sections, 0 if absent
+    uint64_t opi_off;
+    uint64_t sym_off;
+    uint64_t sym_cnt;       // Entries in the symbol section
+} image_hdr_t;
+
+typedef struct image_sym_s
+{
+    uint64_t addr;
+    uint32_t name_off;      // From the start of the symbol section
+    uint32_t name_len;
+} image_sym_t;
+
+i_mem_t *image_load(const char *path);
+
+#endif // __IMAGE_H__
@@ -0,0 +1,193 @@
+/* Tokenizer benchmark
+ *
+ * Build and run as follows:
+ *  $make lexbench && ./lexbench [lines]
+ *
+ * Builds a synthetic trace in memory and reports lines per second for the
+ * old getline/strtok path and for each scanner in lexer.c. The vector
+ * scanners are checked token for token against the scalar one first.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lexer.h"
+
+#define MAXTOKS 32
+#define REPS 5
+
+static const char *sample[] =
+{
+    "add x5, x6, x7\n",
+    "addi x10, x0, 8\n",
+    "ld x9, 16(x20)\n",
+    "sd x28, 0(x20)\n",
+    "slli x11, x25, 3\n",
+    "beq x5, x0, -8\n",
+    "sub  s1,\ta2, t0\r\n",
+    "jalr x1, 24(x1)\n",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *make_trace(uint64_t lines, size_t *size)
+{
+    size_t n = sizeof(sample) / sizeof(sample[0]);
+    size_t cap = lines * 24 + 1;
+    size_t len = 0, l;
+    uint64_t i;
+    char *buf = malloc(cap);
+
+    if(buf == NULL)
+    {
+        fputs("ERROR: Failed to allocate trace\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < lines; i++)
+    {
+        l = strlen(sample[(i * 7) % n]);
+        memcpy(buf + len, sample[(i * 7) % n], l);
+        len += l;
+    }
+    *size = len;
+    return buf;
+}
+
+// What load_instructions() did before: copy each line out, then strtok() it
+static uint64_t run_strtok(const char *buf, size_t size)
+{
+    char line[256];
+    char *tokv[MAXTOKS];
+    const char *p = buf, *end = buf + size, *nl;
+    uint64_t toks = 0;
+    size_t l;
+    int i;
+
+    for(; p < end; p = nl + 1)
+    {
+        nl = memchr(p, '\n', end - p);
+        if(nl == NULL) nl = end;
+        l = nl - p + 1 < sizeof(line) ? nl - p + 1 : sizeof(line) - 1;
+        memcpy(line, p, l);
+        line[l] = '\0';
+
+        i = 0;
+        tokv[i] = strtok(line, ", \n");
+        while(tokv[i++] != NULL)
+        {
+            if(i >= MAXTOKS - 1) tokv[i] = NULL;
+            else tokv[i] = strtok(NULL, ", \n");
+        }
+        toks += i - 1;
+    }
+    return toks;
+}
+
+static uint64_t run_lexer(lex_func_t f, const char *buf, size_t size)
+{
+    tok_t tokv[MAXTOKS];
+    const char *p = buf, *end = buf + size, *next;
+    uint64_t toks = 0;
+
+    for(; p < end; p = next)
+    {
+        toks += f(p, end, tokv, MAXTOKS, &next);
+    }
+    return toks;
+}
+
+static int same_tokens(lex_func_t f, const char *buf, size_t size)
+{
+    tok_t a[MAXTOKS], b[MAXTOKS];
+    const char *p = buf, *end = buf + size, *na, *nb;
+    int ca, cb, i;
+
+    for(; p < end; p = na)
+    {
+        ca = tokenize_scalar(p, end, a, MAXTOKS, &na);
+        cb = f(p, end, b, MAXTOKS, &nb);
+        if(ca != cb || na != nb) return 0;
+        for(i = 0; i < ca; i++)
+        {
+            if(a[i].s != b[i].s || a[i].len != b[i].len || a[i].paren != b[i].paren) return 0;
+        }
+    }
+    return 1;
+}
+
+static void report(const char *name, uint64_t lines, uint64_t toks, double best)
+{
+    printf("%-8s %12.0f lines/s  %8.2f ns/line  (%llu tokens)\n",
+           name, lines / best, best * 1e9 / lines, (unsigned long long)toks);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t lines = argc > 1 ? strtoull(argv[1], NULL, 10) : 4000000;
+    lex_func_t funcs[3];
+    int nfuncs = 0;
+    size_t size;
+    uint64_t toks = 0;
+    double t, best;
+    char *buf;
+    int f, r;
+
+    if(lines == 0)
+    {
+        printf("Usage: %s [lines]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    buf = make_trace(lines, &size);
+    printf("Synthetic trace: %llu lines, %zu bytes, selected scanner: %s\n\n",
+           (unsigned long long)lines, size, lex_name(lex_select()));
+
+    funcs[nfuncs++] = &tokenize_scalar;
+#if LEX_X86
+    funcs[nfuncs++] = &tokenize_sse2;
+    if(lex_has_avx2()) funcs[nfuncs++] = &tokenize_avx2;
+#endif
+
+    for(f = 1; f < nfuncs; f++)
+    {
+        if(!same_tokens(funcs[f], buf, size))
+        {
+            fprintf(stderr, "ERROR: %s scanner disagrees with scalar\n", lex_name(funcs[f]));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    best = 1e30;
+    for(r = 0; r < REPS; r++)
+    {
+        t = now();
+        toks = run_strtok(buf, size);
+        t = now() - t;
+        if(t < best) best = t;
+    }
+    report("strtok", lines, toks, best);
+
+    for(f = 0; f < nfuncs; f++)
+    {
+        best = 1e30;
+        for(r = 0; r < REPS; r++)
+        {
+            t = now();
+            toks = run_lexer(funcs[f], buf, size);
+            t = now() - t;
+            if(t < best) best = t;
+        }
+        report(lex_name(funcs[f]), lines, toks, best);
+    }
+
+    free(buf);
+    return 0;
+}
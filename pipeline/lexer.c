@@ -0,0 +1,208 @@
+#include "lexer.h"
+
+#include <stddef.h>
+
+#if LEX_X86
+#include <immintrin.h>
+#endif
+
+// Tokens of the line being scanned; a token may straddle several blocks
+typedef struct
+{
+    tok_t *tokv;
+    int tokc;
+    int maxtoks;
+    const char *t;  // start of the open token, NULL between tokens
+    const char *pp; // first '(' of the open token
+} lex_state_t;
+
+static lex_func_t lex_impl = NULL;
+
+// Characters that separate tokens within a line
+static inline bool is_delim(char c)
+{
+    return c == ' ' || c == ',' || c == '\t' || c == '\r';
+}
+
+static inline void lex_emit(lex_state_t *st, const char *e)
+{
+    if(st->tokc < st->maxtoks)
+    {
+        st->tokv[st->tokc].s = st->t;
+        st->tokv[st->tokc].len = e - st->t;
+        st->tokv[st->tokc].paren = st->pp ? st->pp - st->t + 1 : 0;
+        st->tokc++;
+    }
+    st->t = NULL;
+    st->pp = NULL;
+}
+
+// Turn the delimiter and paren bitmasks of the block at p into token spans.
+// Only bits below stop (the line end or the block width) are considered.
+static inline void lex_block(lex_state_t *st, const char *p, uint64_t delim, uint64_t paren, unsigned stop)
+{
+    uint64_t live = (1ULL << stop) - 1;
+    uint64_t word = ~delim & live;
+    uint64_t d, pm;
+    unsigned pos = 0;
+    unsigned e;
+
+    for(;;)
+    {
+        if(st->t == NULL)
+        {
+            d = word & (~0ULL << pos);
+            if(d == 0) return;
+            pos = __builtin_ctzll(d);
+            st->t = p + pos;
+        }
+        // Bits past stop are set so the search always terminates
+        e = __builtin_ctzll((delim | ~live) & (~0ULL << pos));
+        if(st->pp == NULL)
+        {
+            pm = paren & (~0ULL << pos) & ((1ULL << e) - 1);
+            if(pm) st->pp = p + __builtin_ctzll(pm);
+        }
+        if(e >= stop) return;
+        lex_emit(st, p + e);
+        pos = e;
+    }
+}
+
+// Byte at a time from p until the end of the line
+static int lex_tail(lex_state_t *st, const char *p, const char *end, const char **next)
+{
+    for(; p < end && *p != '\n'; p++)
+    {
+        if(is_delim(*p))
+        {
+            if(st->t) lex_emit(st, p);
+        }
+        else
+        {
+            if(st->t == NULL) st->t = p;
+            if(*p == '(' && st->pp == NULL) st->pp = p;
+        }
+    }
+    if(st->t) lex_emit(st, p);
+    *next = p < end ? p + 1 : end;
+    return st->tokc;
+}
+
+int tokenize_scalar(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next)
+{
+    lex_state_t st = { tokv, 0, maxtoks, NULL, NULL };
+    return lex_tail(&st, s, end, next);
+}
+
+#if LEX_X86
+int tokenize_sse2(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next)
+{
+    lex_state_t st = { tokv, 0, maxtoks, NULL, NULL };
+    const __m128i sp = _mm_set1_epi8(' ');
+    const __m128i cm = _mm_set1_epi8(',');
+    const __m128i tb = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i lp = _mm_set1_epi8('(');
+    __m128i v, d;
+    uint64_t delim, eol, paren;
+    unsigned stop;
+
+    // Full blocks only, the mapping may end right at the file size
+    for(; end - s >= 16; s += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *)s);
+        d = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, cm)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, tb), _mm_cmpeq_epi8(v, cr)));
+        eol = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        delim = (uint16_t)_mm_movemask_epi8(d) | eol;
+        paren = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lp));
+
+        stop = eol ? __builtin_ctzll(eol) : 16;
+        lex_block(&st, s, delim, paren, stop);
+        if(eol)
+        {
+            if(st.t) lex_emit(&st, s + stop);
+            *next = s + stop + 1;
+            return st.tokc;
+        }
+    }
+    return lex_tail(&st, s, end, next);
+}
+
+__attribute__((target("avx2")))
+int tokenize_avx2(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next)
+{
+    lex_state_t st = { tokv, 0, maxtoks, NULL, NULL };
+    const __m256i sp = _mm256_set1_epi8(' ');
+    const __m256i cm = _mm256_set1_epi8(',');
+    const __m256i tb = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i lp = _mm256_set1_epi8('(');
+    __m256i v, d;
+    uint64_t delim, eol, paren;
+    unsigned stop;
+
+    for(; end - s >= 32; s += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i *)s);
+        d = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, cm)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, tb), _mm256_cmpeq_epi8(v, cr)));
+        eol = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        delim = (uint32_t)_mm256_movemask_epi8(d) | eol;
+        paren = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lp));
+
+        stop = eol ? __builtin_ctzll(eol) : 32;
+        lex_block(&st, s, delim, paren, stop);
+        if(eol)
+        {
+            if(st.t) lex_emit(&st, s + stop);
+            *next = s + stop + 1;
+            return st.tokc;
+        }
+    }
+    return lex_tail(&st, s, end, next);
+}
+
+bool lex_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Pick the widest scanner the CPU supports
+lex_func_t lex_select(void)
+{
+#if LEX_X86
+    if(lex_has_avx2()) return &tokenize_avx2;
+    return &tokenize_sse2;
+#else
+    return &tokenize_scalar;
+#endif
+}
+
+const char *lex_name(lex_func_t f)
+{
+#if LEX_X86
+    if(f == &tokenize_avx2) return "avx2";
+    if(f == &tokenize_sse2) return "sse2";
+#endif
+    return "scalar";
+}
+
+// Choose the scanner up front, before tokenize() is called from several threads
+void lex_init(void)
+{
+    lex_impl = lex_select();
+}
+
+// Split the line starting at s into views of its tokens without copying or
+// modifying it. Returns the token count and points *next at the following line.
+int tokenize(const char *s, const char *end, tok_t tokv[], int maxtoks, const char **next)
+{
+    if(lex_impl == NULL) lex_init();
+    return lex_impl(s, end, tokv, maxtoks, next);
+}
@@ -4,7 +4,13 @@
  *  $make clean && make [VERBOSE=(0|1)]
  *
  * Execute as follows: 
- *  $./RISCV_core <trace file>
+ *  $./RISCV_core [-s] [-w N] [-r M | -p N [-k K]] <trace file | image file>
+ *
+ * -s starts simulating while the trace is still being assembled
+ * -w runs the first N instructions functionally before the pipeline starts
+ * -r stops the pipeline after M instructions and reports their CPI
+ * -p cuts the run into intervals of N instructions and only simulates a
+ *    representative of each phase, clustered into at most K (see simpoint.h)
  *
  * Modified by: Naga Kandasamy
  * Date: September 9, 2024
@@ -16,23 +22,74 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "core.h"
 #include "parser.h"
+#include "image.h"
+#include "fastfwd.h"
+#include "simpoint.h"
 
 int main(int argc, char **argv)
 {	
 
     uint64_t PC = 0;
     i_mem_t *m;
-    instruction_t *ins;
+    pthread_t loader;
+    bool stream = false;
+    bool sampled = false;
+    uint64_t warm = 0, roi = 0, skipped = 0;
+    uint64_t interval = 0, maxk = SIMPOINT_MAXK;
+    simpoint_t *sp;
+    run_status_t status;
+    int opt;
 
-    if (argc != 2) 
+    while ((opt = getopt(argc, argv, "sw:r:p:k:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                stream = true;
+                break;
+            case 'w':
+                warm = strtoull(optarg, NULL, 0);
+                sampled = true;
+                break;
+            case 'r':
+                roi = strtoull(optarg, NULL, 0);
+                sampled = true;
+                break;
+            case 'p':
+                interval = strtoull(optarg, NULL, 0);
+                break;
+            case 'k':
+                maxk = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: %s [-s] [-w N] [-r M | -p N [-k K]] <trace-file>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) 
     {
-        printf("Usage: %s <trace-file>\n", argv[0]);
+        printf("Usage: %s [-s] [-w N] [-r M | -p N [-k K]] <trace-file>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+    if(interval && (roi || maxk == 0))
+    {
+        fputs("ERROR: -p picks its own regions, it takes no -r and needs -k above 0\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+#if VERBOSE == 1
+    // The loader's parse dump would interleave with the per-cycle dump
+    stream = false;
+#endif
     
-    m = load_instructions(argv[1]);
+    // Images from 'assembler -o' are mapped as they are, anything else is a trace
+    m = image_load(argv[optind]);
+    if(m != NULL) stream = false;
+    else if(stream) m = stream_instructions(argv[optind], &loader);
+    else m = load_instructions(argv[optind]);
     if(m == NULL)
     {
         fprintf(stderr, "ERROR: Failed to initialize instruction list\n");
@@ -50,8 +107,33 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    while (core->tick(core));
-    puts("Simulation complete.\n");
+    // The functional run leaves the pipeline empty at the PC it stopped on
+    if(warm) skipped = fastfwd_run(core, warm);
+    if(interval)
+    {
+        sp = simpoint_profile(core, interval);
+        if(sp == NULL || simpoint_cluster(sp, maxk)) exit(EXIT_FAILURE);
+        simpoint_checkpoint(sp, core);
+        simpoint_simulate(sp, core);
+        puts("Sampled simulation complete.\n");
+        simpoint_print(sp);
+        simpoint_delete(sp);
+    }
+    else
+    {
+        if(roi) status = core_run_ins(core, roi);
+        else status = core_run(core, CORE_RUN_FOREVER);
+
+        puts(status == RUN_HALTED ? "Simulation complete.\n" : "Region of interest complete.\n");
+        printf("Cycles: %llu, load-use stalls: %llu\n\n", (unsigned long long)core->clk,
+               (unsigned long long)core->stalls);
+        if(sampled)
+        {
+            printf("Fast-forwarded: %llu instructions\n", (unsigned long long)skipped);
+            printf("Simulated: %llu instructions, CPI: %.3f\n\n", (unsigned long long)core->executed,
+                   core->executed ? (double)core->clk / core->executed : 0.0);
+        }
+    }
 
     print_core_state(core);
     puts("");
@@ -61,8 +143,9 @@ int main(int argc, char **argv)
     unsigned int end = 32;
     print_data_memory(core, start, end);
 
+    if(stream) pthread_join(loader, NULL);
     i_mem_delete(m);
-    free(core);
+    delete_core(core);
     exit(EXIT_SUCCESS);
 }
 
@@ -4,11 +4,18 @@
 #define GNU_SOURCE
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #include "instruction.h"
+#include "lexer.h"
 #include "registers.h"
+#include "symtab.h"
 
 #define MAXTOKS 32
+#define LOAD_CHUNK_MIN (1 << 20) // smallest slice of a trace worth its own thread
+#define LOAD_MAX_THREADS 16
+#define LOAD_PUBLISH_EVERY 1024 // instructions between watermark updates when streaming
 
 typedef struct
 {
@@ -17,17 +24,20 @@ typedef struct
 } immreg_t;
 
 i_mem_t *load_instructions(const char *trace);
-uint32_t handle_instruction(int tokc, char *tokv[], opcode_t *opc);
-uint32_t parse_R_type(opcode_t *opcode, int tokc, char *tokv[]);
-uint32_t parse_I_type(opcode_t *opcode, int tokc, char *tokv[]);
-uint32_t parse_S_type(opcode_t *opcode, int tokc, char *tokv[]);
-uint32_t parse_SB_type(opcode_t *opcode, int tokc, char *tokv[]);
-uint32_t parse_U_type(opcode_t *opcode, int tokc, char *tokv[]);
-uint32_t parse_UJ_type(opcode_t *opcode, int tokc, char *tokv[]);
-uint32_t parse_NULL_type(opcode_t *opcode, int tokc, char *tokv[]);
-int get_reg_imm(char *tok, immreg_t *dest);
-uint32_t get_register_number(char *reg);
-int tokenize(char *s, char *toks[], int maxtoks, char *delim);
+i_mem_t *stream_instructions(const char *trace, pthread_t *tid);
+uint32_t handle_instruction(int tokc, tok_t tokv[], uint8_t *opi, tok_t *label);
+int lookup_opcode(const char *name, size_t len);
+uint32_t parse_R_type(opcode_t *opcode, int tokc, tok_t tokv[]);
+uint32_t parse_I_type(opcode_t *opcode, int tokc, tok_t tokv[]);
+uint32_t parse_S_type(opcode_t *opcode, int tokc, tok_t tokv[]);
+uint32_t parse_SB_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label);
+uint32_t parse_U_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label);
+uint32_t parse_UJ_type(opcode_t *opcode, int tokc, tok_t tokv[], tok_t *label);
+uint32_t parse_NULL_type(opcode_t *opcode, int tokc, tok_t tokv[]);
+int get_reg_imm(tok_t tok, immreg_t *dest);
+uint32_t get_register_number(tok_t reg);
+int32_t get_immediate(tok_t imm);
+int parse_register(const char *reg, size_t len);
 
 #endif // __PARSER_H__
 
@@ -0,0 +1,453 @@
+#include "simpoint.h"
+#include "fastfwd.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Scratch space for the k-means runs
+typedef struct kmeans_s
+{
+    uint64_t *assign;               // Cluster of each interval
+    uint64_t *best;                 // assign of the tightest run so far
+    double *d2;                     // Squared distance of each interval from its nearest centroid
+    uint64_t *members;              // Intervals in each cluster
+    double (*cent)[SIMPOINT_DIMS];
+    double (*best_cent)[SIMPOINT_DIMS];
+    double (*sum)[SIMPOINT_DIMS];
+    double *score;                  // BIC for each k
+} kmeans_t;
+
+// splitmix64 finalizer; seeds the random projection and the k-means runs
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t rng(uint64_t *state)
+{
+    return mix((*state)++);
+}
+
+// Uniform in [0, 1)
+static double unit(uint64_t x)
+{
+    return (x >> 11) * 0x1.0p-53;
+}
+
+// Entry of the random projection matrix for instruction index b, uniform in
+// [-1, 1). It is a hash rather than a table so it costs nothing per
+// instruction of the program.
+static double project(uint64_t b, uint64_t dim)
+{
+    return 2.0 * unit(mix(b * SIMPOINT_DIMS + dim)) - 1.0;
+}
+
+static double dist2(const double *a, const double *b)
+{
+    double d, s = 0;
+    uint64_t j;
+
+    for(j = 0; j < SIMPOINT_DIMS; j++)
+    {
+        d = a[j] - b[j];
+        s += d * d;
+    }
+    return s;
+}
+
+static void save(const core_t *core, checkpoint_t *c)
+{
+    c->PC = core->PC;
+    memcpy(c->reg_file, core->reg_file, sizeof(c->reg_file));
+    memcpy(c->data_mem, core->data_mem, sizeof(c->data_mem));
+}
+
+static void restore(core_t *core, const checkpoint_t *c)
+{
+    core_flush(core);
+    core->PC = c->PC;
+    memcpy(core->reg_file, c->reg_file, sizeof(c->reg_file));
+    memcpy(core->data_mem, c->data_mem, sizeof(c->data_mem));
+}
+
+// Run the rest of the program functionally, cutting it into intervals of
+// size instructions and recording the basic block vector of each. The core
+// is left where the program ended.
+simpoint_t *simpoint_profile(core_t *core, uint64_t size)
+{
+    uint64_t cap = core->dec_mem->src->cap;
+    uint64_t room = 0, len, i, j, b;
+    simpoint_t *sp;
+    interval_t *iv;
+    bbv_t bbv;
+
+    sp = calloc(1, sizeof(simpoint_t));
+    bbv.count = calloc(cap, sizeof(uint64_t));
+    bbv.touched = malloc(cap * sizeof(uint64_t));
+    bbv.n = 0;
+    if(sp == NULL || bbv.count == NULL || bbv.touched == NULL)
+    {
+        fprintf(stderr, "ERROR: Failed to malloc profile\n");
+        free(bbv.count);
+        free(bbv.touched);
+        free(sp);
+        return NULL;
+    }
+    sp->size = size;
+    save(core, &sp->init);
+
+    while((len = fastfwd_profile(core, size, &bbv)) > 0)
+    {
+        if(sp->n == room)
+        {
+            room = room ? room * 2 : 64;
+            iv = realloc(sp->iv, room * sizeof(interval_t));
+            if(iv == NULL)
+            {
+                fprintf(stderr, "ERROR: Failed to malloc profile\n");
+                free(bbv.count);
+                free(bbv.touched);
+                simpoint_delete(sp);
+                return NULL;
+            }
+            sp->iv = iv;
+        }
+
+        // Normalize by the interval's length and project, clearing the
+        // counts for the next interval on the way
+        iv = &sp->iv[sp->n++];
+        iv->start = sp->total;
+        iv->len = len;
+        iv->cluster = 0;
+        memset(iv->bbv, 0, sizeof(iv->bbv));
+        for(i = 0; i < bbv.n; i++)
+        {
+            b = bbv.touched[i];
+            for(j = 0; j < SIMPOINT_DIMS; j++) iv->bbv[j] += bbv.count[b] * project(b, j);
+            bbv.count[b] = 0;
+        }
+        for(j = 0; j < SIMPOINT_DIMS; j++) iv->bbv[j] /= len;
+        bbv.n = 0;
+
+        sp->total += len;
+        if(len < size) break;
+    }
+
+    save(core, &sp->final);
+    free(bbv.count);
+    free(bbv.touched);
+    return sp;
+}
+
+void simpoint_delete(simpoint_t *sp)
+{
+    if(sp == NULL) return;
+    free(sp->iv);
+    free(sp->c);
+    free(sp);
+}
+
+// Nearest centroid to v, its squared distance goes in d2
+static uint64_t nearest(double (*cent)[SIMPOINT_DIMS], uint64_t k, const double *v, double *d2)
+{
+    uint64_t c, best = 0;
+    double d;
+
+    *d2 = dist2(v, cent[0]);
+    for(c = 1; c < k; c++)
+    {
+        d = dist2(v, cent[c]);
+        if(d < *d2)
+        {
+            *d2 = d;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// One k-means run from a k-means++ seeding. Leaves the clusters in km->assign
+// and km->cent and returns the sum of squared distances to the centroids.
+static double kmeans(const simpoint_t *sp, uint64_t k, uint64_t seed, kmeans_t *km)
+{
+    uint64_t i, j, c, it;
+    double r, sse = 0;
+    bool moved = true;
+
+    // Each centroid after the first is an interval drawn with probability
+    // proportional to its squared distance from the nearest one so far
+    i = rng(&seed) % sp->n;
+    memcpy(km->cent[0], sp->iv[i].bbv, sizeof(km->cent[0]));
+    for(i = 0; i < sp->n; i++) km->d2[i] = dist2(sp->iv[i].bbv, km->cent[0]);
+    for(c = 1; c < k; c++)
+    {
+        for(r = 0, i = 0; i < sp->n; i++) r += km->d2[i];
+        r *= unit(rng(&seed));
+        for(i = 0; i < sp->n - 1; i++)
+        {
+            r -= km->d2[i];
+            if(r < 0) break;
+        }
+        memcpy(km->cent[c], sp->iv[i].bbv, sizeof(km->cent[c]));
+        for(i = 0; i < sp->n; i++) km->d2[i] = fmin(km->d2[i], dist2(sp->iv[i].bbv, km->cent[c]));
+    }
+
+    for(i = 0; i < sp->n; i++) km->assign[i] = UINT64_MAX;
+    for(it = 0; it < SIMPOINT_ITERS && moved; it++)
+    {
+        moved = false;
+        for(i = 0; i < sp->n; i++)
+        {
+            c = nearest(km->cent, k, sp->iv[i].bbv, &km->d2[i]);
+            moved |= c != km->assign[i];
+            km->assign[i] = c;
+        }
+
+        // Move each centroid to the mean of its members; an empty cluster stays put
+        memset(km->sum, 0, k * sizeof(km->sum[0]));
+        memset(km->members, 0, k * sizeof(uint64_t));
+        for(i = 0; i < sp->n; i++)
+        {
+            c = km->assign[i];
+            for(j = 0; j < SIMPOINT_DIMS; j++) km->sum[c][j] += sp->iv[i].bbv[j];
+            km->members[c]++;
+        }
+        for(c = 0; c < k; c++)
+        {
+            if(km->members[c] == 0) continue;
+            for(j = 0; j < SIMPOINT_DIMS; j++) km->cent[c][j] = km->sum[c][j] / km->members[c];
+        }
+    }
+
+    for(i = 0; i < sp->n; i++) sse += dist2(sp->iv[i].bbv, km->cent[km->assign[i]]);
+    return sse;
+}
+
+// Tightest of SIMPOINT_SEEDS k-means runs, left in km->best and km->best_cent
+static double kmeans_best(const simpoint_t *sp, uint64_t k, kmeans_t *km)
+{
+    double sse, best = INFINITY;
+    uint64_t s;
+
+    for(s = 0; s < SIMPOINT_SEEDS; s++)
+    {
+        sse = kmeans(sp, k, mix(k * SIMPOINT_SEEDS + s), km);
+        if(sse < best)
+        {
+            best = sse;
+            memcpy(km->best, km->assign, sp->n * sizeof(uint64_t));
+            memcpy(km->best_cent, km->cent, k * sizeof(km->cent[0]));
+        }
+    }
+    return best;
+}
+
+// Bayesian information criterion of the clustering in km->best, modelling
+// the clusters as spherical Gaussians with one shared variance (X-means)
+static double bic(const simpoint_t *sp, uint64_t k, double sse, kmeans_t *km)
+{
+    double R = sp->n, M = SIMPOINT_DIMS, var, l;
+    uint64_t i, c;
+
+    memset(km->members, 0, k * sizeof(uint64_t));
+    for(i = 0; i < sp->n; i++) km->members[km->best[i]]++;
+
+    // A perfect fit would give an infinite likelihood
+    var = R > k ? sse / (M * (R - k)) : 0;
+    if(var < 1e-12) var = 1e-12;
+    l = -R * M / 2 * log(2 * M_PI * var) - M * (R - k) / 2;
+    for(c = 0; c < k; c++)
+    {
+        if(km->members[c]) l += km->members[c] * log(km->members[c] / R);
+    }
+    return l - ((k - 1) + M * k + 1) / 2 * log(R);
+}
+
+static void kmeans_free(kmeans_t *km)
+{
+    free(km->assign);
+    free(km->best);
+    free(km->d2);
+    free(km->members);
+    free(km->cent);
+    free(km->best_cent);
+    free(km->sum);
+    free(km->score);
+}
+
+// Room for n intervals in up to maxk clusters
+static int kmeans_init(kmeans_t *km, uint64_t n, uint64_t maxk)
+{
+    km->assign = malloc(n * sizeof(uint64_t));
+    km->best = malloc(n * sizeof(uint64_t));
+    km->d2 = malloc(n * sizeof(double));
+    km->members = malloc(maxk * sizeof(uint64_t));
+    km->cent = malloc(maxk * sizeof(km->cent[0]));
+    km->best_cent = malloc(maxk * sizeof(km->cent[0]));
+    km->sum = malloc(maxk * sizeof(km->cent[0]));
+    km->score = malloc((maxk + 1) * sizeof(double));
+    if(km->assign == NULL || km->best == NULL || km->d2 == NULL || km->members == NULL ||
+       km->cent == NULL || km->best_cent == NULL || km->sum == NULL || km->score == NULL)
+    {
+        kmeans_free(km);
+        return 1;
+    }
+    return 0;
+}
+
+// Cluster the intervals with k-means for every k up to maxk and keep the
+// smallest k that scores within 90% of the best BIC, as SimPoint does. Each
+// cluster gets the interval closest to its centroid as its point, and one
+// more at random as its spare.
+int simpoint_cluster(simpoint_t *sp, uint64_t maxk)
+{
+    uint64_t k, c, i, seed = 0, seen;
+    double lo = INFINITY, hi = -INFINITY, d;
+    kmeans_t km;
+    cluster_t *cl;
+
+    if(sp->n == 0)
+    {
+        fprintf(stderr, "ERROR: No instructions to profile\n");
+        return 1;
+    }
+    // With one cluster per interval the fit is perfect and BIC means nothing
+    if(maxk >= sp->n) maxk = sp->n > 1 ? sp->n - 1 : 1;
+
+    sp->c = calloc(maxk, sizeof(cluster_t));
+    if(sp->c == NULL || kmeans_init(&km, sp->n, maxk))
+    {
+        fprintf(stderr, "ERROR: Failed to malloc clusters\n");
+        return 1;
+    }
+
+    for(k = 1; k <= maxk; k++)
+    {
+        km.score[k] = bic(sp, k, kmeans_best(sp, k, &km), &km);
+        lo = fmin(lo, km.score[k]);
+        hi = fmax(hi, km.score[k]);
+    }
+    for(k = 1; k < maxk && km.score[k] < lo + 0.9 * (hi - lo); k++);
+    kmeans_best(sp, k, &km);
+
+    // Empty clusters are dropped, the rest are numbered in order
+    sp->k = 0;
+    for(c = 0; c < k; c++)
+    {
+        cl = &sp->c[sp->k];
+        cl->point = UINT64_MAX;
+        d = INFINITY;
+        for(i = 0; i < sp->n; i++)
+        {
+            if(km.best[i] != c) continue;
+            sp->iv[i].cluster = sp->k;
+            cl->weight += sp->iv[i].len;
+            if(dist2(sp->iv[i].bbv, km.best_cent[c]) < d)
+            {
+                d = dist2(sp->iv[i].bbv, km.best_cent[c]);
+                cl->point = i;
+            }
+        }
+        if(cl->point == UINT64_MAX) continue;
+        cl->weight /= sp->total;
+
+        // Reservoir sample over the other members
+        cl->spare = cl->point;
+        for(seen = 0, i = 0; i < sp->n; i++)
+        {
+            if(km.best[i] != c || i == cl->point) continue;
+            if(rng(&seed) % ++seen == 0) cl->spare = i;
+        }
+        sp->k++;
+    }
+
+    kmeans_free(&km);
+    return 0;
+}
+
+// Run the program functionally again from the start, through the same
+// intervals as the profile, saving the state at each point and spare
+void simpoint_checkpoint(simpoint_t *sp, core_t *core)
+{
+    uint64_t i, c, last = 0;
+
+    for(c = 0; c < sp->k; c++)
+    {
+        if(sp->c[c].point > last) last = sp->c[c].point;
+        if(sp->c[c].spare > last) last = sp->c[c].spare;
+    }
+
+    restore(core, &sp->init);
+    for(i = 0; i <= last; i++)
+    {
+        for(c = 0; c < sp->k; c++)
+        {
+            if(sp->c[c].point == i) save(core, &sp->c[c].start[0]);
+            if(sp->c[c].spare == i) save(core, &sp->c[c].start[1]);
+        }
+        if(fastfwd_run(core, sp->size) != sp->iv[i].len)
+        {
+            fputs("ERROR: Checkpoint run diverged from the profile\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// CPI of len instructions on the pipeline, started empty from c
+static double simulate(core_t *core, const checkpoint_t *c, uint64_t len)
+{
+    restore(core, c);
+    core_run_ins(core, len);
+    return core->executed ? (double)core->clk / core->executed : 0.0;
+}
+
+// Simulate every point and spare on the pipeline and weight their CPIs.
+// The clusters are strata with one sample each; the spare gives a second
+// sample of the cluster's CPI, so half the squared difference of the two
+// estimates its variance. Leaves the core in the state the program ended in.
+void simpoint_simulate(simpoint_t *sp, core_t *core)
+{
+    cluster_t *cl;
+    double var = 0;
+    uint64_t c;
+
+    sp->cpi = 0;
+    sp->simulated = 0;
+    for(c = 0; c < sp->k; c++)
+    {
+        cl = &sp->c[c];
+        cl->cpi = simulate(core, &cl->start[0], sp->iv[cl->point].len);
+        sp->simulated += sp->iv[cl->point].len;
+        cl->spare_cpi = cl->cpi;
+        if(cl->spare != cl->point)
+        {
+            cl->spare_cpi = simulate(core, &cl->start[1], sp->iv[cl->spare].len);
+            sp->simulated += sp->iv[cl->spare].len;
+        }
+        sp->cpi += cl->weight * cl->cpi;
+        var += cl->weight * cl->weight * (cl->cpi - cl->spare_cpi) * (cl->cpi - cl->spare_cpi) / 2;
+    }
+    sp->err = sqrt(var);
+    restore(core, &sp->final);
+}
+
+void simpoint_print(simpoint_t *sp)
+{
+    uint64_t c;
+
+    printf("Profiled: %llu instructions in %llu intervals of %llu\n", (unsigned long long)sp->total,
+           (unsigned long long)sp->n, (unsigned long long)sp->size);
+    printf("Simulation points: %llu\n", (unsigned long long)sp->k);
+    for(c = 0; c < sp->k; c++)
+    {
+        printf("\tinterval %llu at instruction %llu: weight %.3f, CPI %.3f\n",
+               (unsigned long long)sp->c[c].point, (unsigned long long)sp->iv[sp->c[c].point].start,
+               sp->c[c].weight, sp->c[c].cpi);
+    }
+    printf("Simulated: %llu instructions\n", (unsigned long long)sp->simulated);
+    printf("Weighted CPI: %.3f +/- %.3f, estimated cycles: %.0f\n\n", sp->cpi, sp->err, sp->cpi * sp->total);
+}
@@ -0,0 +1,69 @@
+#ifndef __SIMPOINT_H__
+#define __SIMPOINT_H__
+
+#include "core.h"
+
+#define SIMPOINT_DIMS 15    // Basic block vectors are projected down to this many dimensions
+#define SIMPOINT_MAXK 10    // Default limit on the number of clusters
+#define SIMPOINT_SEEDS 5    // k-means runs for each k, the tightest one is kept
+#define SIMPOINT_ITERS 100  // Most Lloyd iterations in one k-means run
+
+typedef struct checkpoint_s checkpoint_t;
+typedef struct interval_s interval_t;
+typedef struct cluster_s cluster_t;
+typedef struct simpoint_s simpoint_t;
+
+// Architectural state the pipeline can be started from with empty latches
+struct checkpoint_s
+{
+    addr_t PC;
+    register_t reg_file[NUM_REGISTERS];
+    byte_t data_mem[MEM_SIZE];
+};
+
+// A fixed-size slice of the functional run
+struct interval_s
+{
+    uint64_t start;                 // Instructions executed before it
+    uint64_t len;                   // Instructions in it, a few more than the size when a branch was pending
+    double bbv[SIMPOINT_DIMS];      // Basic block vector, normalized and projected
+    uint64_t cluster;
+};
+
+// Intervals with similar basic block vectors. Its point stands in for all of
+// them; spare is one more member, simulated to see how far the CPI spreads.
+struct cluster_s
+{
+    uint64_t point;         // Interval closest to the centroid
+    uint64_t spare;         // Another interval of the cluster, point if it has only one
+    double weight;          // Share of the program's instructions in the cluster
+    double cpi;             // CPI of point on the pipeline
+    double spare_cpi;
+    checkpoint_t start[2];  // State at the start of point and spare
+};
+
+// SimPoint-style sampled simulation: profile the program functionally, cluster
+// its intervals, then only run one interval per cluster on the pipeline
+struct simpoint_s
+{
+    uint64_t size;          // Instructions per interval
+    uint64_t total;         // Instructions in the program
+    uint64_t n;             // Intervals
+    interval_t *iv;
+    uint64_t k;             // Clusters
+    cluster_t *c;
+    checkpoint_t init;      // State the program started from
+    checkpoint_t final;     // State it ended in
+    uint64_t simulated;     // Instructions run on the pipeline
+    double cpi;             // Weighted CPI of the whole program
+    double err;             // Standard error of cpi
+};
+
+simpoint_t *simpoint_profile(core_t *core, uint64_t size);
+void simpoint_delete(simpoint_t *sp);
+int simpoint_cluster(simpoint_t *sp, uint64_t maxk);
+void simpoint_checkpoint(simpoint_t *sp, core_t *core);
+void simpoint_simulate(simpoint_t *sp, core_t *core);
+void simpoint_print(simpoint_t *sp);
+
+#endif // __SIMPOINT_H__
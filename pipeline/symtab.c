@@ -0,0 +1,198 @@
+#include "symtab.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// FNV-1a
+static uint64_t sym_hash(const char *name, uint32_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t i;
+
+    for(i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Slot holding name, or the empty slot where it belongs
+static sym_t *symtab_slot(sym_t *tab, uint64_t cap, const char *name, uint32_t len, uint64_t hash)
+{
+    uint64_t i = hash & (cap - 1);
+
+    while(tab[i].name != NULL)
+    {
+        if(tab[i].hash == hash && tab[i].len == len && !memcmp(tab[i].name, name, len)) break;
+        i = (i + 1) & (cap - 1);
+    }
+    return &tab[i];
+}
+
+static int symtab_grow(symtab_t *t)
+{
+    uint64_t cap = t->cap * 2;
+    sym_t *tab;
+    uint64_t i;
+
+    tab = calloc(cap, sizeof(sym_t));
+    if(tab == NULL) return 2;
+    for(i = 0; i < t->cap; i++)
+    {
+        if(t->tab[i].name == NULL) continue;
+        *symtab_slot(tab, cap, t->tab[i].name, t->tab[i].len, t->tab[i].hash) = t->tab[i];
+    }
+    free(t->tab);
+    t->tab = tab;
+    t->cap = cap;
+    return 0;
+}
+
+symtab_t *symtab_init(void)
+{
+    symtab_t *t;
+    t = malloc(sizeof(symtab_t));
+    if(t == NULL) return NULL;
+    t->tab = calloc(SYMTAB_MINSZ, sizeof(sym_t));
+    if(t->tab == NULL)
+    {
+        free(t);
+        return NULL;
+    }
+    t->cnt = 0;
+    t->cap = SYMTAB_MINSZ;
+
+    return t;
+}
+
+void symtab_delete(symtab_t *t)
+{
+    if(t == NULL) return;
+    free(t->tab);
+    free(t);
+}
+
+// Define a label. Returns 1 if it is already defined, 2 if out of memory.
+int symtab_add(symtab_t *t, const char *name, uint32_t len, uint64_t addr)
+{
+    uint64_t hash = sym_hash(name, len);
+    sym_t *s;
+
+    if((t->cnt + 1) * 2 > t->cap && symtab_grow(t)) return 2;
+
+    s = symtab_slot(t->tab, t->cap, name, len, hash);
+    if(s->name != NULL) return 1;
+    s->name = name;
+    s->len = len;
+    s->hash = hash;
+    s->addr = addr;
+    t->cnt++;
+    return 0;
+}
+
+const sym_t *symtab_find(symtab_t *t, const char *name, uint32_t len)
+{
+    sym_t *s = symtab_slot(t->tab, t->cap, name, len, sym_hash(name, len));
+    return s->name != NULL ? s : NULL;
+}
+
+// Labels are letters, digits, '_' and '.', not starting with a digit
+bool is_label_name(const char *name, uint32_t len)
+{
+    uint32_t i;
+
+    if(len == 0 || (name[0] >= '0' && name[0] <= '9')) return false;
+    for(i = 0; i < len; i++)
+    {
+        if(!((name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') ||
+             (name[i] >= '0' && name[i] <= '9') || name[i] == '_' || name[i] == '.')) return false;
+    }
+    return true;
+}
+
+relocs_t *relocs_init(void)
+{
+    relocs_t *r;
+    r = malloc(sizeof(relocs_t));
+    if(r == NULL) return NULL;
+    r->r = malloc(RELOC_MINSZ * sizeof(reloc_t));
+    if(r->r == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    r->cnt = 0;
+    r->cap = RELOC_MINSZ;
+
+    return r;
+}
+
+void relocs_delete(relocs_t *r)
+{
+    if(r == NULL) return;
+    free(r->r);
+    free(r);
+}
+
+int relocs_add(relocs_t *r, uint64_t index, const char *name, uint32_t len)
+{
+    reloc_t *n;
+
+    if(r->cnt == r->cap)
+    {
+        n = realloc(r->r, r->cap * 2 * sizeof(reloc_t));
+        if(n == NULL) return 2;
+        r->r = n;
+        r->cap *= 2;
+    }
+    r->r[r->cnt].index = index;
+    r->r[r->cnt].name = name;
+    r->r[r->cnt].len = len;
+    r->cnt++;
+    return 0;
+}
+
+// Fill in the immediate of the instruction at pc so that it refers to addr:
+// SB and UJ get the PC-relative offset, auipc the upper 20 bits of it and
+// lui the upper 20 bits of addr itself. Returns 1 if it does not fit.
+int reloc_apply(uint32_t *bin, uint64_t pc, uint64_t addr)
+{
+    int64_t off = (int64_t)(addr - pc);
+    uint32_t b = *bin;
+    uint32_t imm;
+
+    switch(b & 0x7F)
+    {
+        case 0x63: // SB
+            if(off < -4096 || off > 4094) return 1;
+            imm = off;
+            b &= 0x01FFF07F;
+            b |= ((imm >> 11) & 0x1) << 7;
+            b |= ((imm >> 1) & 0xF) << 8;
+            b |= ((imm >> 5) & 0x3F) << 25;
+            b |= ((imm >> 12) & 0x1) << 31;
+            break;
+        case 0x6F: // UJ
+            if(off < -(1 << 20) || off > (1 << 20) - 2) return 1;
+            imm = off;
+            b &= 0x00000FFF;
+            b |= ((imm >> 12) & 0xFF) << 12;
+            b |= ((imm >> 11) & 0x1) << 20;
+            b |= ((imm >> 1) & 0x3FF) << 21;
+            b |= ((imm >> 20) & 0x1) << 31;
+            break;
+        case 0x17: // auipc
+            if(off < INT32_MIN || off > INT32_MAX) return 1;
+            b = (b & 0xFFF) | (((uint32_t)off + 0x800) & 0xFFFFF000);
+            break;
+        case 0x37: // lui
+            if(addr > INT32_MAX) return 1;
+            b = (b & 0xFFF) | (((uint32_t)addr + 0x800) & 0xFFFFF000);
+            break;
+        default:
+            return 1;
+    }
+    *bin = b;
+    return 0;
+}